@@ -0,0 +1,165 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Copy routines for bcopy packers. The non-temporal variants write the
+ * destination with streaming stores, which bypass the cache: worth it for
+ * large bounce buffers the CPU will not read again, slower for small ones.
+ * They are compiled with target attributes and picked at runtime through
+ * cpuid, so the binary runs on CPUs without AVX2/AVX-512.
+ */
+
+typedef void (*copy_fn_t)(void* dst, const void* src, size_t len);
+
+enum copy_variant_t {
+  COPY_MEMCPY,
+  COPY_AVX2_NT,
+  COPY_AVX512_NT,
+  COPY_AUTO         // memcpy below a threshold, best streaming copy above
+};
+static const char* copy_variant_names[] = {"memcpy", "avx2_nt", "avx512_nt", "auto"};
+
+static const size_t COPY_NT_THRESHOLD = 256 * 1024;  // without bcopy support
+static const size_t COPY_NT_MIN = 4096;              // head and tail dominate below
+
+/*
+ * COPY_AUTO threshold for a transport's bcopy sizes. Every bcopy send fills
+ * a bounce buffer the CPU does not read again, so the upper half of the
+ * bcopy range streams; the threshold stays between COPY_NT_MIN and the L2
+ * size, above which plain stores evict the working set anyway.
+ */
+static size_t copy_tune(size_t max_bcopy) {
+  long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  size_t limit = l2 > 0 ? (size_t)l2 : COPY_NT_THRESHOLD;
+  return std::min(limit, std::max(COPY_NT_MIN, max_bcopy / 2));
+}
+
+static void copy_memcpy(void* dst, const void* src, size_t len) {
+  memcpy(dst, src, len);
+}
+
+#if defined(__x86_64__)
+/*
+ * Align the destination with a plain copy, stream the body, copy the tail.
+ */
+__attribute__((target("avx2")))
+static void copy_avx2_nt(void* dst, const void* src, size_t len) {
+  char* d = (char*)dst;
+  const char* s = (const char*)src;
+  size_t head = (32 - ((uintptr_t)d & 31)) & 31;
+  if (len < head + 128) {
+    memcpy(d, s, len);
+    return;
+  }
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  len -= head;
+
+  for (; len >= 128; len -= 128, d += 128, s += 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)s);
+    __m256i b = _mm256_loadu_si256((const __m256i*)(s + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i*)(s + 64));
+    __m256i e = _mm256_loadu_si256((const __m256i*)(s + 96));
+    _mm256_stream_si256((__m256i*)d, a);
+    _mm256_stream_si256((__m256i*)(d + 32), b);
+    _mm256_stream_si256((__m256i*)(d + 64), c);
+    _mm256_stream_si256((__m256i*)(d + 96), e);
+  }
+  _mm_sfence();
+  memcpy(d, s, len);
+}
+
+__attribute__((target("avx512f")))
+static void copy_avx512_nt(void* dst, const void* src, size_t len) {
+  char* d = (char*)dst;
+  const char* s = (const char*)src;
+  size_t head = (64 - ((uintptr_t)d & 63)) & 63;
+  if (len < head + 256) {
+    memcpy(d, s, len);
+    return;
+  }
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  len -= head;
+
+  for (; len >= 256; len -= 256, d += 256, s += 256) {
+    __m512i a = _mm512_loadu_si512((const void*)s);
+    __m512i b = _mm512_loadu_si512((const void*)(s + 64));
+    __m512i c = _mm512_loadu_si512((const void*)(s + 128));
+    __m512i e = _mm512_loadu_si512((const void*)(s + 192));
+    _mm512_stream_si512((__m512i*)d, a);
+    _mm512_stream_si512((__m512i*)(d + 64), b);
+    _mm512_stream_si512((__m512i*)(d + 128), c);
+    _mm512_stream_si512((__m512i*)(d + 192), e);
+  }
+  _mm_sfence();
+  memcpy(d, s, len);
+}
+#endif
+
+static bool copy_supported(copy_variant_t variant) {
+#if defined(__x86_64__)
+  if (variant == COPY_AVX2_NT) return __builtin_cpu_supports("avx2");
+  if (variant == COPY_AVX512_NT) return __builtin_cpu_supports("avx512f");
+#else
+  if (variant == COPY_AVX2_NT || variant == COPY_AVX512_NT) return false;
+#endif
+  return true;
+}
+
+/*
+ * Returns the copy routine of `variant`, or NULL if the CPU cannot run it.
+ * For COPY_AUTO this is the best streaming copy; callers use it through
+ * copy_sized with their threshold.
+ */
+static copy_fn_t copy_select(copy_variant_t variant) {
+  if (!copy_supported(variant)) return NULL;
+#if defined(__x86_64__)
+  if (variant == COPY_AVX2_NT) return copy_avx2_nt;
+  if (variant == COPY_AVX512_NT) return copy_avx512_nt;
+  if (variant == COPY_AUTO) {
+    return copy_supported(COPY_AVX512_NT) ? copy_avx512_nt :
+           copy_supported(COPY_AVX2_NT) ? copy_avx2_nt : copy_memcpy;
+  }
+#endif
+  return copy_memcpy;
+}
+
+/*
+ * Copy with `copy`, or with memcpy below `nt_threshold`. COPY_AUTO passes
+ * its copy_tune threshold, the fixed variants 0.
+ */
+static inline void copy_sized(copy_fn_t copy, size_t nt_threshold, void* dst, const void* src, size_t len) {
+  if (len < nt_threshold) {
+    memcpy(dst, src, len);
+  } else {
+    copy(dst, src, len);
+  }
+}
+
+struct copy_frag {
+  const void* data;
+  size_t len;
+};
+
+/*
+ * Gather `n` fragments into `dst` with copy_sized. Returns the packed length.
+ */
+static size_t copy_gather(copy_fn_t copy, size_t nt_threshold, void* dst, const copy_frag* frags, int n) {
+  char* d = (char*)dst;
+  for (int i = 0; i < n; ++i) {
+    copy_sized(copy, nt_threshold, d, frags[i].data, frags[i].len);
+    d += frags[i].len;
+  }
+  return d - (char*)dst;
+}
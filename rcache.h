@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <map>
+#include <vector>
+
+#include <uct/api/uct.h>
+
+#include "util.h"
+
+/*
+ * Registration cache for zero-copy sends. Registered regions are kept
+ * page-aligned and disjoint in a tree ordered by start address, so the one
+ * region that may contain a buffer is found with a single lookup. A miss
+ * merges the overlapping unused regions with the buffer into one region.
+ * Unused regions stay registered on an LRU list until the registered bytes
+ * exceed the capacity.
+ *
+ * The cache does not watch for unmapped memory: buffers must stay mapped
+ * while they are cached, or be dropped with rcache_cleanup.
+ */
+
+struct rcache_region {
+  uintptr_t start, end;
+  uct_mem_h memh;
+  int refcount;
+  bool cached;                                   // false if registered around the cache
+  std::list<rcache_region*>::iterator lru_it;    // valid while unused
+};
+
+struct rcache {
+  uct_md_h md;
+  unsigned access;
+  size_t capacity;                               // bytes
+  size_t size;                                   // bytes registered by cached regions
+  std::map<uintptr_t, rcache_region*> regions;   // by start address
+  std::list<rcache_region*> lru;                 // unused regions, least recent first
+  long hits, misses, evictions;
+};
+
+static const uintptr_t RCACHE_ALIGN = 4096;
+
+static void rcache_init(rcache* rc, uct_md_h md, unsigned access, size_t capacity) {
+  rc->md = md;
+  rc->access = access;
+  rc->capacity = capacity;
+  rc->size = 0;
+  rc->hits = rc->misses = rc->evictions = 0;
+}
+
+static void rcache_region_destroy(rcache* rc, rcache_region* region) {
+  ucs_status_t status = uct_md_mem_dereg(rc->md, region->memh);
+  CHECK_UCS(status);
+  delete region;
+}
+
+/*
+ * Remove an unused region from the cache and deregister it.
+ */
+static void rcache_evict(rcache* rc, rcache_region* region) {
+  rc->lru.erase(region->lru_it);
+  rc->regions.erase(region->start);
+  rc->size -= region->end - region->start;
+  rcache_region_destroy(rc, region);
+}
+
+/*
+ * Return a registered region containing [addr, addr + len) and take a
+ * reference to it. Release it with rcache_put.
+ */
+static rcache_region* rcache_get(rcache* rc, void* addr, size_t len) {
+  uintptr_t start = (uintptr_t)addr & ~(RCACHE_ALIGN - 1);
+  uintptr_t end = ((uintptr_t)addr + len + RCACHE_ALIGN - 1) & ~(RCACHE_ALIGN - 1);
+
+  /*
+   * The only candidate is the last region starting at or before `start`
+   */
+  auto it = rc->regions.upper_bound(start);
+  if (it != rc->regions.begin()) {
+    rcache_region* region = std::prev(it)->second;
+    if (region->end >= end) {
+      if (region->refcount++ == 0) {
+        rc->lru.erase(region->lru_it);
+      }
+      ++rc->hits;
+      return region;
+    }
+    if (region->end > start) --it;
+  }
+  ++rc->misses;
+
+  /*
+   * Merge with the overlapping regions, unless one of them is in use. In that
+   * case register the buffer alone and keep it out of the cache.
+   */
+  std::vector<rcache_region*> overlap;
+  bool cached = true;
+  for (; it != rc->regions.end() && it->first < end; ++it) {
+    overlap.push_back(it->second);
+    cached = cached && it->second->refcount == 0;
+  }
+  if (cached) {
+    for (rcache_region* old : overlap) {
+      start = std::min(start, old->start);
+      end = std::max(end, old->end);
+      rcache_evict(rc, old);
+    }
+  }
+
+  rcache_region* region = new rcache_region;
+  region->start = start;
+  region->end = end;
+  region->refcount = 1;
+  region->cached = cached;
+  ucs_status_t status = uct_md_mem_reg(rc->md, (void*)start, end - start, rc->access, &region->memh);
+  CHECK_UCS(status);
+
+  if (cached) {
+    rc->regions[start] = region;
+    rc->size += end - start;
+  }
+  return region;
+}
+
+/*
+ * Drop a reference taken by rcache_get. Unused regions over the capacity are
+ * evicted, least recently used first.
+ */
+static void rcache_put(rcache* rc, rcache_region* region) {
+  if (--region->refcount > 0) return;
+
+  if (!region->cached) {
+    rcache_region_destroy(rc, region);
+    return;
+  }
+  region->lru_it = rc->lru.insert(rc->lru.end(), region);
+
+  while (rc->size > rc->capacity && !rc->lru.empty()) {
+    rcache_evict(rc, rc->lru.front());
+    ++rc->evictions;
+  }
+}
+
+/*
+ * Deregister all unused regions. Regions still in use are leaked.
+ */
+static void rcache_cleanup(rcache* rc) {
+  while (!rc->lru.empty()) {
+    rcache_evict(rc, rc->lru.front());
+  }
+  if (!rc->regions.empty()) {
+    printf("rcache: %ld regions still in use\n", rc->regions.size());
+  }
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <uct/api/uct.h>
+
+#include "util.h"
+
+/*
+ * Minimal RPC layer over UCT short active messages.
+ *
+ * Each method owns one AM ID; the dispatch table maps AM IDs to handlers.
+ * Requests and responses travel on the method's AM ID, with the 64-bit short
+ * AM header carrying:
+ *
+ *   63          32 31       16 15      8 7       0
+ *   +-------------+-----------+---------+--------+
+ *   |   req_id    |  unused   | status  |  kind  |
+ *   +-------------+-----------+---------+--------+
+ *
+ * The caller's completion is found by req_id, which is a slot index in the
+ * low RPC_SLOT_BITS bits plus a generation counter, so stale or duplicated
+ * responses are detected.
+ */
+
+enum rpc_kind_t {
+  RPC_REQUEST,
+  RPC_RESPONSE
+};
+
+static const int RPC_SLOT_BITS = 12;
+static const uint32_t RPC_MAX_INFLIGHT = 1u << RPC_SLOT_BITS;
+static const size_t RPC_MAX_PAYLOAD = 4096;
+
+static inline uint64_t rpc_header(rpc_kind_t kind, uint8_t status, uint32_t req_id) {
+  return (uint64_t)req_id << 32 | (uint64_t)status << 8 | kind;
+}
+static inline rpc_kind_t rpc_header_kind(uint64_t header) { return (rpc_kind_t)(header & 0xff); }
+static inline uint8_t rpc_header_status(uint64_t header) { return (header >> 8) & 0xff; }
+static inline uint32_t rpc_header_req_id(uint64_t header) { return header >> 32; }
+
+/*
+ * Server side: handle a request, write the response to `resp` (at most
+ * `max_resp` bytes), set its length and return a status for the caller.
+ */
+typedef uint8_t (*rpc_handler_t)(void* arg, const void* req, size_t len, void* resp, size_t max_resp,
+                                 size_t* resp_len);
+/*
+ * Caller side: the response arrived.
+ */
+typedef void (*rpc_done_t)(void* arg, uint8_t status, const void* resp, size_t len);
+
+struct rpc_ctx;
+
+struct rpc_method {
+  rpc_ctx* ctx;
+  uint8_t am_id;
+  rpc_handler_t handler;
+  void* arg;
+};
+
+struct rpc_slot {
+  uint32_t req_id;
+  bool busy;
+  rpc_done_t done;
+  void* arg;
+};
+
+struct rpc_deferred {
+  uint8_t am_id;
+  uint64_t header;
+  std::string payload;
+};
+
+struct rpc_ctx {
+  uct_worker_h worker;
+  uct_ep_h ep;
+  size_t max_payload;                 // short AM payload after the header
+  rpc_method methods[UCT_AM_ID_MAX];
+  std::vector<rpc_slot> slots;
+  std::vector<uint32_t> free_slots;
+  std::deque<rpc_deferred> deferred;  // responses waiting for resources
+  char resp_buf[RPC_MAX_PAYLOAD];
+  long served, completed, stale;
+};
+
+static void rpc_init(rpc_ctx* ctx, uct_worker_h worker, uct_ep_h ep, const uct_iface_attr_t& iface_attr) {
+  CHECK_COND(iface_attr.cap.flags & UCT_IFACE_FLAG_AM_SHORT);
+  ctx->worker = worker;
+  ctx->ep = ep;
+  ctx->max_payload = std::min(RPC_MAX_PAYLOAD, iface_attr.cap.am.max_short - sizeof(uint64_t));
+  for (int i = 0; i < UCT_AM_ID_MAX; ++i) {
+    ctx->methods[i].handler = NULL;
+  }
+  ctx->slots.resize(RPC_MAX_INFLIGHT);
+  for (uint32_t i = 0; i < RPC_MAX_INFLIGHT; ++i) {
+    ctx->slots[i].req_id = i;
+    ctx->slots[i].busy = false;
+    ctx->free_slots.push_back(RPC_MAX_INFLIGHT - 1 - i);
+  }
+  ctx->served = ctx->completed = ctx->stale = 0;
+}
+
+static ucs_status_t rpc_send(rpc_ctx* ctx, uint8_t am_id, uint64_t header, const void* payload, size_t len) {
+  return uct_ep_am_short(ctx->ep, am_id, header, payload, len);
+}
+
+static void rpc_respond(rpc_ctx* ctx, uint8_t am_id, uint64_t header, const void* payload, size_t len) {
+  if (ctx->deferred.empty() && rpc_send(ctx, am_id, header, payload, len) != UCS_ERR_NO_RESOURCE) {
+    return;
+  }
+  rpc_deferred resp;
+  resp.am_id = am_id;
+  resp.header = header;
+  resp.payload.assign((const char*)payload, len);
+  ctx->deferred.push_back(resp);
+}
+
+static ucs_status_t rpc_am_cb(void* arg, void* data, size_t length, unsigned flags) {
+  rpc_method* m = (rpc_method*)arg;
+  rpc_ctx* ctx = m->ctx;
+  uint64_t header = *(uint64_t*)data;
+  const char* payload = (const char*)data + sizeof(header);
+  size_t len = length - sizeof(header);
+  uint32_t req_id = rpc_header_req_id(header);
+
+  if (rpc_header_kind(header) == RPC_REQUEST) {
+    size_t resp_len = 0;
+    uint8_t status = m->handler(m->arg, payload, len, ctx->resp_buf, ctx->max_payload, &resp_len);
+    ++ctx->served;
+    rpc_respond(ctx, m->am_id, rpc_header(RPC_RESPONSE, status, req_id), ctx->resp_buf, resp_len);
+    return UCS_OK;
+  }
+
+  rpc_slot& slot = ctx->slots[req_id & (RPC_MAX_INFLIGHT - 1)];
+  if (!slot.busy || slot.req_id != req_id) {
+    ++ctx->stale;
+    return UCS_OK;
+  }
+  slot.busy = false;
+  slot.req_id += RPC_MAX_INFLIGHT;  // next generation
+  ctx->free_slots.push_back(req_id & (RPC_MAX_INFLIGHT - 1));
+  ++ctx->completed;
+  slot.done(slot.arg, rpc_header_status(header), payload, len);
+  return UCS_OK;
+}
+
+/*
+ * Put `handler` in the dispatch table on `am_id` of `iface`. Both sides
+ * register the same methods, the caller needs them to receive responses.
+ */
+static void rpc_register(rpc_ctx* ctx, uct_iface_h iface, uint8_t am_id, rpc_handler_t handler, void* arg) {
+  rpc_method* m = &ctx->methods[am_id];
+  m->ctx = ctx;
+  m->am_id = am_id;
+  m->handler = handler;
+  m->arg = arg;
+  ucs_status_t status = uct_iface_set_am_handler(iface, am_id, rpc_am_cb, m, 0);
+  CHECK_UCS(status);
+}
+
+/*
+ * Issue a request. Returns UCS_ERR_NO_RESOURCE if all slots are in use or
+ * the transport is busy; progress and try again.
+ */
+static ucs_status_t rpc_call(rpc_ctx* ctx, uint8_t am_id, const void* req, size_t len, rpc_done_t done, void* arg) {
+  CHECK_COND(ctx->methods[am_id].handler != NULL && len <= ctx->max_payload);
+  if (ctx->free_slots.empty()) return UCS_ERR_NO_RESOURCE;
+
+  rpc_slot& slot = ctx->slots[ctx->free_slots.back()];
+  ucs_status_t status = rpc_send(ctx, am_id, rpc_header(RPC_REQUEST, 0, slot.req_id), req, len);
+  if (status != UCS_OK) return status;
+
+  ctx->free_slots.pop_back();
+  slot.busy = true;
+  slot.done = done;
+  slot.arg = arg;
+  return UCS_OK;
+}
+
+/*
+ * Progress the worker and retry deferred responses. Returns true once
+ * nothing is deferred.
+ */
+static bool rpc_progress(rpc_ctx* ctx) {
+  uct_worker_progress(ctx->worker);
+  while (!ctx->deferred.empty()) {
+    const rpc_deferred& resp = ctx->deferred.front();
+    ucs_status_t status = rpc_send(ctx, resp.am_id, resp.header, resp.payload.data(), resp.payload.size());
+    if (status == UCS_ERR_NO_RESOURCE) return false;
+    CHECK_UCS(status);
+    ctx->deferred.pop_front();
+  }
+  return true;
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <uct/api/uct.h>
+
+#include "util.h"
+
+/*
+ * Receive descriptor pool for active message handlers.
+ *
+ * Every received message is described by a recv_desc_t placed right before
+ * its payload. If UCT hands over its own descriptor (UCT_CB_PARAM_FLAG_DESC)
+ * the recv_desc_t lives in the rx_headroom and the descriptor is retained.
+ * Otherwise the payload is copied into a preallocated slab element, or into a
+ * heap buffer if the slab is exhausted or the message does not fit.
+ *
+ * Handlers hand descriptors to the consumer through an intrusive lock-free
+ * MPSC queue. Free slab elements are kept in a lock-free stack which is
+ * pushed by the consumer and popped by the handler. The consumer releases
+ * descriptors in batches of RX_RELEASE_BATCH.
+ */
+
+enum recv_desc_kind_t {
+  RECV_DESC_UCT,    // retained UCT descriptor, see uct_iface_release_desc
+  RECV_DESC_POOL,   // slab element
+  RECV_DESC_HEAP    // malloc'ed, pool exhausted or message too large
+};
+
+struct recv_desc_t {
+  std::atomic<recv_desc_t*> next;
+  uint32_t length;
+  uint8_t kind;
+};
+
+static inline void* recv_desc_data(recv_desc_t* desc) {
+  return desc + 1;
+}
+
+static const int RX_RELEASE_BATCH = 32;
+
+struct rx_pool {
+  char* slab;
+  size_t elem_size;                        // rx_headroom + max_payload
+  size_t max_payload;
+  size_t count;
+  std::atomic<recv_desc_t*> free_head;     // popped by handlers only
+
+  recv_desc_t stub;
+  std::atomic<recv_desc_t*> tail;          // pushed by handlers
+  recv_desc_t* head;                       // popped by the consumer
+
+  recv_desc_t* release[RX_RELEASE_BATCH];  // consumer side
+  int num_release;
+
+  long retained, copied, overflow, batches;
+};
+
+static void rx_pool_free_push(rx_pool* pool, recv_desc_t* desc) {
+  recv_desc_t* head = pool->free_head.load(std::memory_order_relaxed);
+  do {
+    desc->next.store(head, std::memory_order_relaxed);
+  } while (!pool->free_head.compare_exchange_weak(head, desc, std::memory_order_release,
+                                                  std::memory_order_relaxed));
+}
+
+/*
+ * Only one thread pops, so a popped element cannot be pushed back between the
+ * load and the exchange (no ABA).
+ */
+static recv_desc_t* rx_pool_free_pop(rx_pool* pool) {
+  recv_desc_t* head = pool->free_head.load(std::memory_order_acquire);
+  while (head != NULL &&
+         !pool->free_head.compare_exchange_weak(head, head->next.load(std::memory_order_relaxed),
+                                                std::memory_order_acquire, std::memory_order_acquire)) {
+  }
+  return head;
+}
+
+static void rx_pool_enqueue(rx_pool* pool, recv_desc_t* desc) {
+  desc->next.store(NULL, std::memory_order_relaxed);
+  recv_desc_t* prev = pool->tail.exchange(desc, std::memory_order_acq_rel);
+  prev->next.store(desc, std::memory_order_release);
+}
+
+/*
+ * Create a pool of `count` elements for payloads of up to `max_payload`
+ * bytes. `rx_headroom` must match the one the iface was opened with.
+ */
+static rx_pool* rx_pool_create(size_t count, size_t rx_headroom, size_t max_payload) {
+  CHECK_COND(rx_headroom >= sizeof(recv_desc_t));
+  rx_pool* pool = new rx_pool;
+  pool->elem_size = (rx_headroom + max_payload + 63) & ~(size_t)63;
+  pool->max_payload = max_payload;
+  pool->count = count;
+  pool->slab = (char*)aligned_alloc(64, pool->elem_size * count);
+  CHECK_COND(pool->slab != NULL);
+
+  pool->free_head.store(NULL);
+  for (size_t i = 0; i < count; ++i) {
+    recv_desc_t* desc = (recv_desc_t*)(pool->slab + i * pool->elem_size);
+    desc->kind = RECV_DESC_POOL;
+    rx_pool_free_push(pool, desc);
+  }
+
+  pool->stub.next.store(NULL);
+  pool->tail.store(&pool->stub);
+  pool->head = &pool->stub;
+  pool->num_release = 0;
+  pool->retained = pool->copied = pool->overflow = pool->batches = 0;
+  return pool;
+}
+
+/*
+ * Called from an AM handler: queue the message for the consumer. Returns the
+ * status the handler should return to UCT.
+ */
+static ucs_status_t rx_pool_deliver(rx_pool* pool, void* data, size_t length, unsigned flags) {
+  recv_desc_t* desc;
+  ucs_status_t status;
+
+  if (flags & UCT_CB_PARAM_FLAG_DESC) {
+    desc = (recv_desc_t*)data - 1;
+    desc->kind = RECV_DESC_UCT;
+    ++pool->retained;
+    status = UCS_INPROGRESS;
+  } else {
+    desc = length <= pool->max_payload ? rx_pool_free_pop(pool) : NULL;
+    if (desc == NULL) {
+      desc = (recv_desc_t*)malloc(sizeof(*desc) + length);
+      desc->kind = RECV_DESC_HEAP;
+      ++pool->overflow;
+    } else {
+      ++pool->copied;
+    }
+    memcpy(recv_desc_data(desc), data, length);
+    status = UCS_OK;
+  }
+
+  desc->length = length;
+  rx_pool_enqueue(pool, desc);
+  return status;
+}
+
+/*
+ * Consumer side: next received descriptor, or NULL. Pass it to
+ * rx_pool_release when done with the payload.
+ */
+static recv_desc_t* rx_pool_pop(rx_pool* pool) {
+  recv_desc_t* head = pool->head;
+  recv_desc_t* next = head->next.load(std::memory_order_acquire);
+
+  if (head == &pool->stub) {
+    if (next == NULL) return NULL;
+    pool->head = head = next;
+    next = next->next.load(std::memory_order_acquire);
+  }
+  if (next != NULL) {
+    pool->head = next;
+    return head;
+  }
+
+  /*
+   * `head` is the last one. Put the stub behind it so it can be taken,
+   * unless a handler is in the middle of enqueuing after it.
+   */
+  if (head != pool->tail.load(std::memory_order_acquire)) return NULL;
+  rx_pool_enqueue(pool, &pool->stub);
+  next = head->next.load(std::memory_order_acquire);
+  if (next != NULL) {
+    pool->head = next;
+    return head;
+  }
+  return NULL;
+}
+
+static void rx_pool_flush(rx_pool* pool) {
+  for (int i = 0; i < pool->num_release; ++i) {
+    recv_desc_t* desc = pool->release[i];
+    if (desc->kind == RECV_DESC_UCT) {
+      uct_iface_release_desc(desc);
+    } else if (desc->kind == RECV_DESC_POOL) {
+      rx_pool_free_push(pool, desc);
+    } else {
+      free(desc);
+    }
+  }
+  if (pool->num_release > 0) ++pool->batches;
+  pool->num_release = 0;
+}
+
+static void rx_pool_release(rx_pool* pool, recv_desc_t* desc) {
+  pool->release[pool->num_release++] = desc;
+  if (pool->num_release == RX_RELEASE_BATCH) {
+    rx_pool_flush(pool);
+  }
+}
+
+/*
+ * Release everything still queued. Must run before the iface is closed.
+ */
+static void rx_pool_destroy(rx_pool* pool) {
+  recv_desc_t* desc;
+  while ((desc = rx_pool_pop(pool)) != NULL) {
+    rx_pool_release(pool, desc);
+  }
+  rx_pool_flush(pool);
+  free(pool->slab);
+  delete pool;
+}
+
+static void rx_pool_print(const rx_pool* pool) {
+  if (pool->retained + pool->copied + pool->overflow == 0) return;
+  printf("rx pool: %ld retained, %ld copied, %ld heap fallbacks, %ld release batches\n",
+      pool->retained, pool->copied, pool->overflow, pool->batches);
+}
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+#include <uct/api/uct.h>
+
+#include "util.h"
+
+/*
+ * Send scheduler for active messages over several endpoints.
+ *
+ * A send that finds the transport out of resources is queued on its
+ * endpoint's FIFO instead of spinning. The endpoint then waits on the UCT
+ * pending queue (uct_ep_pending_add), and its pending callback only marks it
+ * ready. sched_progress serves ready endpoints round-robin, at most
+ * SCHED_QUANTUM messages each per turn, so one busy endpoint cannot starve
+ * the others. Transports without UCT_IFACE_FLAG_PENDING are polled instead.
+ */
+
+static const int SCHED_QUANTUM = 4;
+
+struct sched_msg {
+  uint8_t id;
+  const void* data;   // must stay valid until sent
+  size_t len;         // at least 8, the first 8 bytes are the short AM header
+  double submitted;
+};
+
+struct send_sched;
+
+struct sched_ep {
+  uct_pending_req_t req;    // must be first, see sched_pending_cb
+  send_sched* sched;
+  uct_ep_h ep;
+  std::deque<sched_msg> fifo;
+  bool waiting;             // req is on the UCT pending queue
+  bool ready;               // on the ready ring
+  long sent, queued;
+  size_t max_depth;
+  double stall_sum, stall_max;
+};
+
+struct send_sched {
+  uct_worker_h worker;
+  size_t max_short;
+  bool use_pending;
+  std::vector<sched_ep*> eps;
+  std::deque<sched_ep*> ready;
+  latency_histogram delay;  // submit to post, ns, every message
+};
+
+static void sched_init(send_sched* s, uct_worker_h worker, const uct_iface_attr_t& iface_attr) {
+  s->worker = worker;
+  s->max_short = iface_attr.cap.flags & UCT_IFACE_FLAG_AM_SHORT ? iface_attr.cap.am.max_short : 0;
+  s->use_pending = iface_attr.cap.flags & UCT_IFACE_FLAG_PENDING;
+  hist_init(&s->delay);
+}
+
+static size_t sched_packer(void* dest, void* arg) {
+  sched_msg* msg = (sched_msg*)arg;
+  memcpy(dest, msg->data, msg->len);
+  return msg->len;
+}
+
+static ucs_status_t sched_post(sched_ep* sep, sched_msg& msg) {
+  if (msg.len <= sep->sched->max_short) {
+    return uct_ep_am_short(sep->ep, msg.id, *(const uint64_t*)msg.data, (const char*)msg.data + sizeof(uint64_t),
+                           msg.len - sizeof(uint64_t));
+  }
+  ssize_t len = uct_ep_am_bcopy(sep->ep, msg.id, sched_packer, &msg, 0);
+  return len >= 0 ? UCS_OK : (ucs_status_t)len;
+}
+
+static void sched_make_ready(sched_ep* sep) {
+  if (!sep->ready) {
+    sep->ready = true;
+    sep->sched->ready.push_back(sep);
+  }
+}
+
+static ucs_status_t sched_pending_cb(uct_pending_req_t* req) {
+  sched_ep* sep = (sched_ep*)req;
+  sep->waiting = false;
+  sched_make_ready(sep);
+  return UCS_OK;
+}
+
+static void sched_purge_cb(uct_pending_req_t* req, void* arg) {
+  ((sched_ep*)req)->waiting = false;
+}
+
+/*
+ * The endpoint has queued messages and no resources: wait for the pending
+ * callback, or retry on the next turn if it cannot wait.
+ */
+static void sched_block(sched_ep* sep) {
+  if (sep->waiting) return;
+  if (sep->sched->use_pending) {
+    ucs_status_t status = uct_ep_pending_add(sep->ep, &sep->req, 0);
+    if (status == UCS_OK) {
+      sep->waiting = true;
+      return;
+    }
+    CHECK_COND(status == UCS_ERR_BUSY);  // resources came back meanwhile
+  }
+  sched_make_ready(sep);
+}
+
+static sched_ep* sched_add_ep(send_sched* s, uct_ep_h ep) {
+  sched_ep* sep = new sched_ep;
+  sep->req.func = sched_pending_cb;
+  sep->sched = s;
+  sep->ep = ep;
+  sep->waiting = sep->ready = false;
+  sep->sent = sep->queued = 0;
+  sep->max_depth = 0;
+  sep->stall_sum = sep->stall_max = 0;
+  s->eps.push_back(sep);
+  return sep;
+}
+
+static void sched_sent(sched_ep* sep, const sched_msg& msg) {
+  double stall = GetTime() - msg.submitted;
+  ++sep->sent;
+  hist_record(&sep->sched->delay, (uint64_t)(stall * 1e9));
+  if (stall > 0) {
+    sep->stall_sum += stall;
+    sep->stall_max = std::max(sep->stall_max, stall);
+  }
+}
+
+/*
+ * Send now if the endpoint has nothing queued and resources are available,
+ * otherwise queue. Never blocks.
+ */
+static void sched_send(sched_ep* sep, uint8_t id, const void* data, size_t len) {
+  sched_msg msg;
+  msg.id = id;
+  msg.data = data;
+  msg.len = len;
+  msg.submitted = GetTime();
+
+  if (sep->fifo.empty()) {
+    ucs_status_t status = sched_post(sep, msg);
+    if (status != UCS_ERR_NO_RESOURCE) {
+      CHECK_UCS(status);
+      ++sep->sent;
+      hist_record(&sep->sched->delay, 0);
+      return;
+    }
+  }
+
+  sep->fifo.push_back(msg);
+  ++sep->queued;
+  sep->max_depth = std::max(sep->max_depth, sep->fifo.size());
+  sched_block(sep);
+}
+
+/*
+ * Progress the worker, then give every ready endpoint one turn.
+ */
+static void sched_progress(send_sched* s) {
+  uct_worker_progress(s->worker);
+
+  for (size_t n = s->ready.size(); n > 0; --n) {
+    sched_ep* sep = s->ready.front();
+    s->ready.pop_front();
+    sep->ready = false;
+
+    int quantum = SCHED_QUANTUM;
+    ucs_status_t status = UCS_OK;
+    while (quantum > 0 && !sep->fifo.empty()) {
+      status = sched_post(sep, sep->fifo.front());
+      if (status == UCS_ERR_NO_RESOURCE) break;
+      CHECK_UCS(status);
+      sched_sent(sep, sep->fifo.front());
+      sep->fifo.pop_front();
+      --quantum;
+    }
+
+    if (sep->fifo.empty()) continue;
+    if (status == UCS_ERR_NO_RESOURCE) {
+      sched_block(sep);
+    } else {
+      sched_make_ready(sep);
+    }
+  }
+}
+
+static bool sched_idle(const send_sched* s) {
+  for (const sched_ep* sep : s->eps) {
+    if (!sep->fifo.empty()) return false;
+  }
+  return true;
+}
+
+static void sched_print(const send_sched* s) {
+  printf("%6s %10s %10s %10s %14s %14s\n", "ep", "sent", "queued", "max depth", "avg stall (us)", "max stall (us)");
+  for (size_t i = 0; i < s->eps.size(); ++i) {
+    const sched_ep* sep = s->eps[i];
+    printf("%6lu %10ld %10ld %10lu %14.2f %14.2f\n", i, sep->sent, sep->queued, sep->max_depth,
+        sep->queued ? sep->stall_sum * 1e6 / sep->queued : 0.0, sep->stall_max * 1e6);
+  }
+}
+
+/*
+ * Drop queued messages and pending requests. The endpoints stay open.
+ */
+static void sched_cleanup(send_sched* s) {
+  for (sched_ep* sep : s->eps) {
+    if (sep->waiting) {
+      uct_ep_pending_purge(sep->ep, sched_purge_cb, NULL);
+    }
+    delete sep;
+  }
+  s->eps.clear();
+  s->ready.clear();
+}
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+
+#include <uct/api/uct.h>
+
+#include "util.h"
+
+/*
+ * Software tag matching over active messages, for transports without tag
+ * offload. Completions go through the same uct_tag_context_t callbacks as
+ * uct_iface_tag_recv_zcopy, so callers drive both the same way.
+ *
+ * Eager messages carry the tag in front of the payload. Rendezvous sends
+ * only announce the tag, address and length of the sender's buffer (RTS),
+ * and the receiver fetches the data with uct_ep_get_zcopy once it has
+ * matched a receive. Messages without a matching receive are kept on the
+ * unexpected queue; eager payloads are copied there.
+ */
+
+struct sw_tm_recv {
+  uct_tag_t tag, mask;
+  void* buf;
+  size_t len;
+  uct_mem_h memh;
+  uct_tag_context_t* ctx;
+};
+
+struct sw_tm_rts {
+  uint64_t address;
+  uint64_t length;
+};
+
+struct sw_tm_unexp {
+  uct_tag_t tag;
+  bool rndv;
+  sw_tm_rts rts;
+  std::string data;     // eager payload
+};
+
+struct sw_tm_get {
+  uct_completion_t comp;  // must be first, see sw_tm_get_cb
+  uct_tag_context_t* ctx;
+  uct_tag_t tag;
+  size_t len;
+  uct_iov_t iov;
+  uint64_t address;
+};
+
+struct sw_tm {
+  uct_ep_h ep;
+  uct_rkey_t peer_rkey;          // covers the buffers the peer sends with rndv
+  uint8_t eager_id, rts_id;
+  std::deque<sw_tm_recv> expected;
+  std::deque<sw_tm_unexp> unexpected;
+  std::deque<sw_tm_get*> gets;   // waiting for resources
+  long unexpected_count;
+};
+
+struct sw_tm_pack_args {
+  uct_tag_t tag;
+  const void* data;
+  size_t len;
+};
+
+static size_t sw_tm_packer(void* dest, void* arg) {
+  sw_tm_pack_args* args = (sw_tm_pack_args*)arg;
+  memcpy(dest, &args->tag, sizeof(args->tag));
+  memcpy((char*)dest + sizeof(args->tag), args->data, args->len);
+  return sizeof(args->tag) + args->len;
+}
+
+static void sw_tm_get_cb(uct_completion_t* self, ucs_status_t status) {
+  sw_tm_get* get = (sw_tm_get*)self;
+  get->ctx->completed_cb(get->ctx, get->tag, 0, get->len, NULL, status);
+  delete get;
+}
+
+static bool sw_tm_try_get(sw_tm* tm, sw_tm_get* get) {
+  ucs_status_t status = uct_ep_get_zcopy(tm->ep, &get->iov, 1, get->address, tm->peer_rkey, &get->comp);
+  if (status == UCS_ERR_NO_RESOURCE) return false;
+  if (status != UCS_INPROGRESS) {
+    sw_tm_get_cb(&get->comp, status);
+  }
+  return true;
+}
+
+/*
+ * Start fetching a matched rendezvous message into `recv`.
+ */
+static void sw_tm_start_get(sw_tm* tm, const sw_tm_recv& recv, uct_tag_t tag, const sw_tm_rts& rts) {
+  CHECK_COND(rts.length <= recv.len);
+  sw_tm_get* get = new sw_tm_get;
+  get->comp.func = sw_tm_get_cb;
+  get->comp.count = 1;
+  get->ctx = recv.ctx;
+  get->tag = tag;
+  get->len = rts.length;
+  get->iov.buffer = recv.buf;
+  get->iov.length = rts.length;
+  get->iov.memh = recv.memh;
+  get->iov.stride = 0;
+  get->iov.count = 1;
+  get->address = rts.address;
+  if (!tm->gets.empty() || !sw_tm_try_get(tm, get)) {
+    tm->gets.push_back(get);
+  }
+}
+
+static void sw_tm_deliver(sw_tm* tm, const sw_tm_recv& recv, uct_tag_t tag, const void* data, size_t len) {
+  CHECK_COND(len <= recv.len);
+  memcpy(recv.buf, data, len);
+  recv.ctx->completed_cb(recv.ctx, tag, 0, len, NULL, UCS_OK);
+}
+
+/*
+ * Find and remove the first expected receive matching `tag`.
+ */
+static bool sw_tm_match(sw_tm* tm, uct_tag_t tag, sw_tm_recv* recv) {
+  for (auto it = tm->expected.begin(); it != tm->expected.end(); ++it) {
+    if (((it->tag ^ tag) & it->mask) == 0) {
+      *recv = *it;
+      tm->expected.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+static ucs_status_t sw_tm_eager_cb(void* arg, void* data, size_t length, unsigned flags) {
+  sw_tm* tm = (sw_tm*)arg;
+  uct_tag_t tag;
+  memcpy(&tag, data, sizeof(tag));
+  const char* payload = (const char*)data + sizeof(tag);
+  size_t len = length - sizeof(tag);
+
+  sw_tm_recv recv;
+  if (sw_tm_match(tm, tag, &recv)) {
+    sw_tm_deliver(tm, recv, tag, payload, len);
+  } else {
+    sw_tm_unexp unexp;
+    unexp.tag = tag;
+    unexp.rndv = false;
+    unexp.data.assign(payload, len);
+    tm->unexpected.push_back(unexp);
+    ++tm->unexpected_count;
+  }
+  return UCS_OK;
+}
+
+static ucs_status_t sw_tm_rts_cb(void* arg, void* data, size_t length, unsigned flags) {
+  sw_tm* tm = (sw_tm*)arg;
+  uct_tag_t tag = *(uint64_t*)data;
+  sw_tm_rts rts;
+  memcpy(&rts, (char*)data + sizeof(tag), sizeof(rts));
+
+  sw_tm_recv recv;
+  if (sw_tm_match(tm, tag, &recv)) {
+    sw_tm_start_get(tm, recv, tag, rts);
+  } else {
+    sw_tm_unexp unexp;
+    unexp.tag = tag;
+    unexp.rndv = true;
+    unexp.rts = rts;
+    tm->unexpected.push_back(unexp);
+    ++tm->unexpected_count;
+  }
+  return UCS_OK;
+}
+
+/*
+ * Register the eager and RTS handlers on `eager_id` and `rts_id`.
+ */
+static void sw_tm_init(sw_tm* tm, uct_iface_h iface, uct_ep_h ep, uct_rkey_t peer_rkey, uint8_t eager_id,
+                       uint8_t rts_id) {
+  tm->ep = ep;
+  tm->peer_rkey = peer_rkey;
+  tm->eager_id = eager_id;
+  tm->rts_id = rts_id;
+  tm->unexpected_count = 0;
+  ucs_status_t status = uct_iface_set_am_handler(iface, eager_id, sw_tm_eager_cb, tm, 0);
+  CHECK_UCS(status);
+  status = uct_iface_set_am_handler(iface, rts_id, sw_tm_rts_cb, tm, 0);
+  CHECK_UCS(status);
+}
+
+/*
+ * Post a receive, like uct_iface_tag_recv_zcopy. Matches the unexpected
+ * queue first. `memh` must cover `buf` if rendezvous messages may match.
+ */
+static void sw_tm_post(sw_tm* tm, uct_tag_t tag, uct_tag_t mask, void* buf, size_t len, uct_mem_h memh,
+                       uct_tag_context_t* ctx) {
+  sw_tm_recv recv;
+  recv.tag = tag;
+  recv.mask = mask;
+  recv.buf = buf;
+  recv.len = len;
+  recv.memh = memh;
+  recv.ctx = ctx;
+
+  for (auto it = tm->unexpected.begin(); it != tm->unexpected.end(); ++it) {
+    if (((it->tag ^ tag) & mask) == 0) {
+      if (it->rndv) {
+        sw_tm_start_get(tm, recv, it->tag, it->rts);
+      } else {
+        sw_tm_deliver(tm, recv, it->tag, it->data.data(), it->data.size());
+      }
+      tm->unexpected.erase(it);
+      return;
+    }
+  }
+  tm->expected.push_back(recv);
+}
+
+static ssize_t sw_tm_eager_send(sw_tm* tm, uct_tag_t tag, const void* data, size_t len) {
+  sw_tm_pack_args args;
+  args.tag = tag;
+  args.data = data;
+  args.len = len;
+  return uct_ep_am_bcopy(tm->ep, tm->eager_id, sw_tm_packer, &args, 0);
+}
+
+/*
+ * Announce `len` bytes at `data`. The buffer must stay untouched until the
+ * peer has fetched it.
+ */
+static ucs_status_t sw_tm_rndv_send(sw_tm* tm, uct_tag_t tag, const void* data, size_t len) {
+  sw_tm_rts rts;
+  rts.address = (uintptr_t)data;
+  rts.length = len;
+  return uct_ep_am_short(tm->ep, tm->rts_id, tag, &rts, sizeof(rts));
+}
+
+/*
+ * Retry rendezvous fetches that found the transport busy.
+ */
+static void sw_tm_progress(sw_tm* tm) {
+  while (!tm->gets.empty() && sw_tm_try_get(tm, tm->gets.front())) {
+    tm->gets.pop_front();
+  }
+}
@@ -1,27 +1,175 @@
 #include <cstdio>
 #include <cstring>
 #include <cassert>
+#include <cerrno>
+#include <deque>
+#include <numeric>
+#include <string>
 #include <vector>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include <ucp/api/ucp.h>
 
 #include "util.h"
 
-enum test_mode_t {
-  TEST_MODE_PROBE,
-  TEST_MODE_WAIT,
-  TEST_MODE_EVENTFD
+static progress_mode_t progress_mode = PROGRESS_MODE_POLL;
+static thread_local progress_engine* engine;
+
+enum recv_mode_t {
+  RECV_MODE_PROBE,
+  RECV_MODE_RING,
+  RECV_MODE_BOTH
+};
+static const char* recv_mode_names[] = {"probe", "ring", "both"};
+static recv_mode_t recv_mode = RECV_MODE_PROBE;
+static int recv_ring_depth = 8;
+
+/*
+ * Messaging APIs compared by the sweep, selected with -a
+ */
+enum sweep_api_t {
+  API_TAG,
+  API_AM,
+  API_STREAM,
+  API_RMA,
+  API_DT
+};
+static const char* api_names[] = {"tag", "am", "stream", "rma", "dt"};
+static const int API_COUNT = sizeof(api_names) / sizeof(api_names[0]);
+static unsigned sweep_apis = UCS_BIT(API_TAG);
+
+/*
+ * One row of the sweep table: how the message is sent and received
+ */
+enum xfer_t {
+  XFER_TAG_PROBE,
+  XFER_TAG_RING,
+  XFER_AM_EAGER,
+  XFER_AM_RNDV,
+  XFER_STREAM_RECV,
+  XFER_STREAM_DATA,
+  XFER_RMA_PUT,
+  XFER_RMA_GET,
+  XFER_DT_PACK,
+  XFER_DT_IOV,
+  XFER_DT_GENERIC
+};
+static const char* xfer_names[] = {"tag/probe", "tag/ring", "am/eager", "am/rndv", "stream/recv", "stream/data",
+                                   "rma/put", "rma/get", "dt/pack", "dt/iov", "dt/generic"};
+
+/*
+ * How the message buffer is allocated and registered, selected with -M
+ */
+enum alloc_mode_t {
+  ALLOC_MALLOC,   // registered lazily by UCP on first use
+  ALLOC_MAP,      // malloc, then ucp_mem_map
+  ALLOC_UCP,      // ucp_mem_map with UCP_MEM_MAP_ALLOCATE
+  ALLOC_HUGE_2M,  // mmap with MAP_HUGETLB, then ucp_mem_map
+  ALLOC_HUGE_1G
 };
-static test_mode_t test_mode = TEST_MODE_PROBE;
+static const char* alloc_mode_names[] = {"malloc", "map", "ucp", "huge2m", "huge1g"};
+static alloc_mode_t alloc_mode = ALLOC_MALLOC;
+static int numa_node = -1;      // -1: no binding
+static bool numa_local = false;
+static ucp_mem_h msg_memh = NULL;
+
+static bool sweep_mode = false;
+static size_t sweep_min_len = 1;
+static size_t sweep_max_len = 1L * 1024 * 1024 * 1024;
+static int warmup_iters = 10;
+static int measure_iters = 100;
+static int send_window = 1;
+static int num_clients = 1;
+static int num_threads = 1;
+
+static const ucp_tag_t tag = 0x1337A880;
+static const ucp_tag_t ack_tag = 0x1337A881;
+static const ucp_tag_t rkey_tag = 0x1337A882;
+static const ucp_tag_t tag_mask = 0xFFFFFFFF;
+static const unsigned am_id = 0;
+static const size_t STREAM_CHUNK = 64 * 1024;
+static const size_t STREAM_MIN_BYTES = 16L * 1024 * 1024;
+static const size_t STREAM_MAX_BYTES = 4L * 1024 * 1024 * 1024;
+static const size_t DT_MAX_SEG = 1024 * 1024;
+static const size_t dt_seg_counts[] = {1, 4, 16, 64, 256};
 
 struct my_context {
   int completed;
 };
 
+struct send_window_t;
+
+/*
+ * Per-slot context of a send window. Passed as user_data to every send posted
+ * from this slot, so completions never touch a shared context.
+ */
+struct send_slot {
+  send_window_t* win;
+};
+
+struct send_window_t {
+  ucp_ep_h ep;
+  xfer_t xfer;
+  char* msg;
+  size_t len;
+  long total;      // number of sends to post, or -1 for unlimited
+  long posted;
+  long completed;
+  double last_completion;
+  std::vector<double>* samples;
+  std::vector<send_slot> slots;
+  ucp_request_param_t param;
+};
+
+struct client_conn {
+  ucp_ep_h ep;
+  send_window_t win;
+  std::vector<double> samples;
+  double end;
+};
+
+/*
+ * A data worker of the multi-client server: one ucp_worker_h and progress
+ * engine per thread, serving every client whose endpoint lives on it.
+ */
+struct data_worker {
+  int index;
+  ucp_worker_h worker;
+  progress_engine engine;
+  std::vector<client_conn*> conns;
+  char* msg;
+  double start;
+  pthread_t thread;
+};
+
+static std::vector<client_conn> client_conns;
+static std::vector<data_worker> data_workers;
+static pthread_barrier_t data_barrier;
+
 struct listener_context {
   std::vector<ucp_conn_request_h> reqs;
 };
 
+/*
+ * AM messages seen by am_recv_handler and not yet received. `desc` is the
+ * data descriptor to pass to ucp_am_recv_data_nbx, or NULL if the handler
+ * already copied the data into `buf`.
+ */
+struct am_msg {
+  void* desc;
+  size_t length;
+};
+
+struct am_inbox_t {
+  char* buf;
+  std::deque<am_msg> msgs;
+};
+static am_inbox_t am_inbox;
+
 static void request_init(void *request) {
   my_context* ctx = (my_context*)request;
   ctx->completed = 0;
@@ -55,18 +203,1304 @@ static void server_conn_handle_cb(ucp_conn_request_h conn_request, void *arg) {
   ctx->reqs.push_back(conn_request);
 }
 
+static unsigned worker_progress_cb(void* arg) {
+  return ucp_worker_progress((ucp_worker_h)arg);
+}
+
+static ucs_status_t worker_arm_cb(void* arg) {
+  return ucp_worker_arm((ucp_worker_h)arg);
+}
+
+static ucs_status_t worker_wait_cb(void* arg) {
+  return ucp_worker_wait((ucp_worker_h)arg);
+}
+
+/*
+ * Quiet callbacks for the sweep; they run once per message and must not print.
+ */
+static void sweep_send_cb(void *request, ucs_status_t status, void *user_data) {
+  CHECK_UCS(status);
+  ((my_context*)request)->completed = 1;
+}
+
+static void sweep_recv_cb(void *request, ucs_status_t status, const ucp_tag_recv_info_t *info, void *user_data) {
+  CHECK_UCS(status);
+  ((my_context*)request)->completed = 1;
+}
+
+static void sweep_length_recv_cb(void *request, ucs_status_t status, size_t length, void *user_data) {
+  CHECK_UCS(status);
+  ((my_context*)request)->completed = 1;
+}
+
+/*
+ * Keep rendezvous and persistent eager data for ucp_am_recv_data_nbx. Other
+ * eager data is only valid during the callback and is copied right away.
+ */
+static ucs_status_t am_recv_handler(void *arg, const void *header, size_t header_length, void *data, size_t length,
+                                    const ucp_am_recv_param_t *param) {
+  am_inbox_t* inbox = (am_inbox_t*)arg;
+  am_msg msg;
+  msg.length = length;
+  if (param->recv_attr & (UCP_AM_RECV_ATTR_FLAG_RNDV | UCP_AM_RECV_ATTR_FLAG_DATA)) {
+    msg.desc = data;
+    inbox->msgs.push_back(msg);
+    return UCS_INPROGRESS;
+  }
+  memcpy(inbox->buf, data, length);
+  msg.desc = NULL;
+  inbox->msgs.push_back(msg);
+  return UCS_OK;
+}
+
+/*
+ * Post a send of `xfer`. AM sends force the eager or rendezvous protocol.
+ * Both stream rows send with ucp_stream_send_nbx; they differ on the receiver.
+ */
+static ucs_status_ptr_t xfer_send(ucp_ep_h ep, xfer_t xfer, const char* msg, size_t len,
+                                  const ucp_request_param_t* param) {
+  if (xfer == XFER_AM_EAGER || xfer == XFER_AM_RNDV) {
+    ucp_request_param_t am_param = *param;
+    am_param.op_attr_mask |= UCP_OP_ATTR_FIELD_FLAGS;
+    am_param.flags = xfer == XFER_AM_EAGER ? UCP_AM_SEND_FLAG_EAGER : UCP_AM_SEND_FLAG_RNDV;
+    return ucp_am_send_nbx(ep, am_id, NULL, 0, msg, len, &am_param);
+  } else if (xfer == XFER_STREAM_RECV || xfer == XFER_STREAM_DATA) {
+    return ucp_stream_send_nbx(ep, msg, len, param);
+  }
+  return ucp_tag_send_nbx(ep, msg, len, tag, param);
+}
+
+/*
+ * Wait for a non-blocking operation posted with a sweep callback and release
+ * its request. Immediate completion (UCS_OK) returns right away.
+ */
+static void request_wait(ucp_worker_h ucp_worker, ucs_status_ptr_t request, const char* what) {
+  if (UCS_PTR_IS_ERR(request)) {
+    printf("UCP %s failed. (%s)\n", what, ucs_status_string(UCS_PTR_STATUS(request)));
+    exit(EXIT_FAILURE);
+  }
+  if (UCS_PTR_IS_PTR(request)) {
+    my_context* ctx = (my_context*)request;
+    progress_until(engine, [&] { return ctx->completed != 0; });
+    ctx->completed = 0;
+    ucp_request_free(request);
+  }
+}
+
+static void ep_close(ucp_worker_h ucp_worker, ucp_ep_h ep) {
+  ucp_request_param_t param;
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK;
+  param.cb.send = sweep_send_cb;
+  request_wait(ucp_worker, ucp_ep_close_nbx(ep, &param), "ep close");
+}
+
+static void window_send_cb(void *request, ucs_status_t status, void *user_data);
+
+static void window_complete(send_window_t* win) {
+  double now = GetTime();
+  if (win->samples) win->samples->push_back(now - win->last_completion);
+  win->last_completion = now;
+  ++win->completed;
+}
+
+/*
+ * Keep posting from `slot` until a send is actually in flight or the window
+ * has posted everything. Sends completed inline do not get a callback.
+ */
+static void window_post(send_slot* slot) {
+  send_window_t* win = slot->win;
+  while (win->total < 0 || win->posted < win->total) {
+    ++win->posted;
+    win->param.user_data = slot;
+    ucs_status_ptr_t request = xfer_send(win->ep, win->xfer, win->msg, win->len, &win->param);
+    if (UCS_PTR_IS_PTR(request)) return;
+    if (UCS_PTR_IS_ERR(request)) {
+      printf("UCP send failed. (%s)\n", ucs_status_string(UCS_PTR_STATUS(request)));
+      exit(EXIT_FAILURE);
+    }
+    window_complete(win);
+  }
+}
+
+/*
+ * Refill the window from the completion callback, so the link never idles
+ * waiting for the main loop to notice.
+ */
+static void window_send_cb(void *request, ucs_status_t status, void *user_data) {
+  CHECK_UCS(status);
+  send_slot* slot = (send_slot*)user_data;
+  ucp_request_free(request);
+  window_complete(slot->win);
+  window_post(slot);
+}
+
+static void window_start(send_window_t* win, ucp_ep_h ep, xfer_t xfer, char* msg, size_t len, long total,
+                         std::vector<double>* samples) {
+  win->ep = ep;
+  win->xfer = xfer;
+  win->msg = msg;
+  win->len = len;
+  win->total = total;
+  win->posted = 0;
+  win->completed = 0;
+  win->last_completion = GetTime();
+  win->samples = samples;
+  win->slots.assign(send_window, send_slot{win});
+  win->param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK
+                          | UCP_OP_ATTR_FIELD_USER_DATA;
+  win->param.cb.send = window_send_cb;
+
+  for (send_slot& slot : win->slots) {
+    window_post(&slot);
+  }
+}
+
+/*
+ * Sender side of one sweep step: send `iters` messages of `len` bytes, each
+ * acknowledged by the receiver before the next one is posted. A sample is the
+ * time between consecutive acknowledgements. With a send window, up to
+ * `send_window` messages are in flight, a sample is the time between send
+ * completions and only the whole batch is acknowledged.
+ * Returns the total elapsed time.
+ */
+static double sweep_send_batch(ucp_worker_h ucp_worker, ucp_ep_h ep, xfer_t xfer, char* msg, size_t len,
+                               int iters, std::vector<double>* samples) {
+  ucp_request_param_t send_param;
+  send_param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK;
+  send_param.cb.send = sweep_send_cb;
+
+  ucp_request_param_t ack_param;
+  ack_param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK;
+  ack_param.cb.recv = sweep_recv_cb;
+
+  char ack;
+  double st = GetTime(), prev = st;
+
+  if (send_window > 1) {
+    ucs_status_ptr_t ack_req = ucp_tag_recv_nbx(ucp_worker, &ack, sizeof(ack), ack_tag, tag_mask, &ack_param);
+    send_window_t win;
+    window_start(&win, ep, xfer, msg, len, iters, samples);
+    progress_until(engine, [&] { return win.completed >= iters; });
+    request_wait(ucp_worker, ack_req, "ack receive");
+    return GetTime() - st;
+  }
+
+  for (int i = 0; i < iters; ++i) {
+    /*
+     * Post the ack receive first so the ack never hits the unexpected queue
+     */
+    ucs_status_ptr_t ack_req = ucp_tag_recv_nbx(ucp_worker, &ack, sizeof(ack), ack_tag, tag_mask, &ack_param);
+    ucs_status_ptr_t send_req = xfer_send(ep, xfer, msg, len, &send_param);
+    request_wait(ucp_worker, send_req, "send");
+    request_wait(ucp_worker, ack_req, "ack receive");
+
+    double now = GetTime();
+    if (samples) samples->push_back(now - prev);
+    prev = now;
+  }
+  return prev - st;
+}
+
+/*
+ * Stop-and-wait acknowledges every message. A send window or a multi-client
+ * server only acknowledges the last message of each batch.
+ */
+static bool ack_every_message() {
+  return send_window == 1 && num_clients == 1;
+}
+
+/*
+ * Acknowledge message `i` of a batch, see ack_every_message().
+ */
+static void sweep_ack(ucp_worker_h ucp_worker, ucp_ep_h ep, int i, int iters) {
+  if (!ack_every_message() && i != iters - 1) return;
+
+  ucp_request_param_t ack_param;
+  ack_param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK;
+  ack_param.cb.send = sweep_send_cb;
+
+  static char ack = 0;
+  request_wait(ucp_worker, ucp_tag_send_nbx(ep, &ack, sizeof(ack), ack_tag, &ack_param), "ack send");
+}
+
+/*
+ * Receiver side of one sweep step: probe, receive and acknowledge `iters`
+ * messages of `len` bytes. Returns the total elapsed time.
+ */
+static double sweep_recv_batch(ucp_worker_h ucp_worker, ucp_ep_h ep, char* msg, size_t len,
+                               int iters, std::vector<double>* samples) {
+  ucp_request_param_t recv_param;
+  recv_param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK;
+  recv_param.cb.recv = sweep_recv_cb;
+
+  ucp_tag_message_h msg_tag;
+  ucp_tag_recv_info_t info_tag;
+  double st = GetTime(), prev = st;
+  for (int i = 0; i < iters; ++i) {
+    progress_until(engine, [&] {
+      msg_tag = ucp_tag_probe_nb(ucp_worker, tag, tag_mask, 1, &info_tag);
+      return msg_tag != NULL;
+    });
+    CHECK_COND(info_tag.length == len);
+
+    request_wait(ucp_worker, ucp_tag_msg_recv_nbx(ucp_worker, msg, len, msg_tag, &recv_param), "receive");
+    sweep_ack(ucp_worker, ep, i, iters);
+
+    double now = GetTime();
+    if (samples) samples->push_back(now - prev);
+    prev = now;
+  }
+  return prev - st;
+}
+
+/*
+ * Receiver side of one sweep step with pre-posted receives: keep a ring of
+ * ucp_tag_recv_nbx requests on rotating slices of `msg`, so eager data can
+ * land directly in the user buffer. Receives with the same tag match in
+ * posting order, so slot i % depth always completes next. The ring is no
+ * deeper than what fits in the message buffer.
+ */
+static double sweep_ring_recv_batch(ucp_worker_h ucp_worker, ucp_ep_h ep, char* msg, size_t len,
+                                    int iters, std::vector<double>* samples) {
+  ucp_request_param_t recv_param;
+  recv_param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK;
+  recv_param.cb.recv = sweep_recv_cb;
+
+  int depth = (int)std::min<size_t>(recv_ring_depth, sweep_max_len / len);
+  std::vector<ucs_status_ptr_t> ring(depth);
+  int posted = 0;
+  for (; posted < depth && posted < iters; ++posted) {
+    ring[posted] = ucp_tag_recv_nbx(ucp_worker, msg + posted * len, len, tag, tag_mask, &recv_param);
+  }
+
+  double st = GetTime(), prev = st;
+  for (int i = 0; i < iters; ++i) {
+    int slot = i % depth;
+    request_wait(ucp_worker, ring[slot], "receive");
+
+    /*
+     * Repost before acknowledging, so the buffer is ready for the next send
+     */
+    if (posted < iters) {
+      ring[slot] = ucp_tag_recv_nbx(ucp_worker, msg + slot * len, len, tag, tag_mask, &recv_param);
+      ++posted;
+    }
+    sweep_ack(ucp_worker, ep, i, iters);
+
+    double now = GetTime();
+    if (samples) samples->push_back(now - prev);
+    prev = now;
+  }
+  return prev - st;
+}
+
+/*
+ * Receiver side of one AM sweep step: wait for am_recv_handler to see each
+ * message, fetch it into `msg` with ucp_am_recv_data_nbx unless the handler
+ * already copied it, and acknowledge.
+ */
+static double sweep_am_recv_batch(ucp_worker_h ucp_worker, ucp_ep_h ep, char* msg, size_t len,
+                                  int iters, std::vector<double>* samples) {
+  ucp_request_param_t recv_param;
+  recv_param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK;
+  recv_param.cb.recv_am = sweep_length_recv_cb;
+
+  am_inbox.buf = msg;
+  double st = GetTime(), prev = st;
+  for (int i = 0; i < iters; ++i) {
+    progress_until(engine, [&] { return !am_inbox.msgs.empty(); });
+    am_msg m = am_inbox.msgs.front();
+    am_inbox.msgs.pop_front();
+    CHECK_COND(m.length == len);
+
+    if (m.desc) {
+      request_wait(ucp_worker, ucp_am_recv_data_nbx(ucp_worker, m.desc, msg, len, &recv_param), "AM receive");
+    }
+    sweep_ack(ucp_worker, ep, i, iters);
+
+    double now = GetTime();
+    if (samples) samples->push_back(now - prev);
+    prev = now;
+  }
+  return prev - st;
+}
+
+static double sweep_batch(ucp_worker_h ucp_worker, ucp_ep_h ep, char* msg, size_t len,
+                          bool is_sender, xfer_t xfer, int iters, std::vector<double>* samples) {
+  if (iters == 0) {
+    return 0;
+  } else if (is_sender) {
+    return sweep_send_batch(ucp_worker, ep, xfer, msg, len, iters, samples);
+  } else if (xfer == XFER_AM_EAGER || xfer == XFER_AM_RNDV) {
+    return sweep_am_recv_batch(ucp_worker, ep, msg, len, iters, samples);
+  } else if (xfer == XFER_TAG_RING) {
+    return sweep_ring_recv_batch(ucp_worker, ep, msg, len, iters, samples);
+  } else {
+    return sweep_recv_batch(ucp_worker, ep, msg, len, iters, samples);
+  }
+}
+
+/*
+ * Sender side of one stream step: write `total` bytes as one continuous
+ * stream of `chunk` sized sends through a send window, then wait for the
+ * receiver's ack. Returns the elapsed time.
+ */
+static double stream_send_batch(ucp_worker_h ucp_worker, ucp_ep_h ep, xfer_t xfer, char* msg, size_t chunk,
+                                size_t total, long* calls) {
+  ucp_request_param_t ack_param;
+  ack_param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK;
+  ack_param.cb.recv = sweep_recv_cb;
+
+  char ack;
+  double st = GetTime();
+  ucs_status_ptr_t ack_req = ucp_tag_recv_nbx(ucp_worker, &ack, sizeof(ack), ack_tag, tag_mask, &ack_param);
+  send_window_t win;
+  *calls = total / chunk;
+  window_start(&win, ep, xfer, msg, chunk, *calls, NULL);
+  progress_until(engine, [&] { return win.completed >= *calls; });
+  request_wait(ucp_worker, ack_req, "ack receive");
+  return GetTime() - st;
+}
+
+static volatile uint64_t read_sink;
+
+/*
+ * Receiver side of one stream step: consume `total` bytes in reads of `len`.
+ * XFER_STREAM_RECV copies every read into `msg` with ucp_stream_recv_nbx and
+ * UCP_STREAM_RECV_FLAG_WAITALL. XFER_STREAM_DATA takes whatever UCP has
+ * received with ucp_stream_recv_data_nb and walks it in place in `len`
+ * pieces, touching one byte of each, before releasing it.
+ */
+static double stream_recv_batch(ucp_worker_h ucp_worker, ucp_ep_h ep, xfer_t xfer, char* msg, size_t len,
+                                size_t total, long* calls) {
+  ucp_request_param_t recv_param;
+  recv_param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK
+                          | UCP_OP_ATTR_FIELD_FLAGS;
+  recv_param.cb.recv_stream = sweep_length_recv_cb;
+  recv_param.flags = UCP_STREAM_RECV_FLAG_WAITALL;
+
+  double st = GetTime();
+  size_t received = 0;
+  uint64_t sum = 0;
+  *calls = 0;
+  while (received < total) {
+    size_t length;
+    if (xfer == XFER_STREAM_RECV) {
+      length = std::min(len, total - received);
+      size_t recv_length;
+      request_wait(ucp_worker, ucp_stream_recv_nbx(ep, msg, length, &recv_length, &recv_param), "stream receive");
+    } else {
+      ucs_status_ptr_t data;
+      progress_until(engine, [&] {
+        data = ucp_stream_recv_data_nb(ep, &length);
+        return data != NULL;
+      });
+      if (UCS_PTR_IS_ERR(data)) {
+        printf("UCP stream receive failed. (%s)\n", ucs_status_string(UCS_PTR_STATUS(data)));
+        exit(EXIT_FAILURE);
+      }
+      for (size_t off = 0; off < length; off += len) {
+        sum += ((const char*)data)[off];
+      }
+      ucp_stream_data_release(ep, data);
+    }
+    received += length;
+    ++*calls;
+  }
+  read_sink = sum;
+  sweep_ack(ucp_worker, ep, 0, 1);
+  return GetTime() - st;
+}
+
+/*
+ * `total` must be a multiple of `chunk`.
+ */
+static double stream_batch(ucp_worker_h ucp_worker, ucp_ep_h ep, xfer_t xfer, char* msg, size_t len, size_t chunk,
+                           bool is_sender, size_t total, long* calls) {
+  if (is_sender) {
+    return stream_send_batch(ucp_worker, ep, xfer, msg, chunk, total, calls);
+  }
+  return stream_recv_batch(ucp_worker, ep, xfer, msg, len, total, calls);
+}
+
+/*
+ * Stream bandwidth against the application read size: the server writes a
+ * continuous byte stream in STREAM_CHUNK sends, and the client reads it in
+ * every sweep size, copying (stream/recv) or zero-copy (stream/data). A step
+ * moves len * measure_iters bytes, clamped to STREAM_MIN_BYTES and
+ * STREAM_MAX_BYTES. "calls" counts sends on the server, receive calls on the
+ * client.
+ */
+static void run_stream(ucp_worker_h ucp_worker, ucp_ep_h ep, char* msg, bool is_sender) {
+  printf("%12s %12s %12s %10s %12s %10s %7s\n",
+      "read size", "method", "bytes", "calls", "bytes/call", "GB/s", "cpu%");
+
+  size_t chunk = std::min(STREAM_CHUNK, sweep_max_len);
+  for (size_t len = sweep_min_len; len <= sweep_max_len; len *= 2) {
+    for (int x = XFER_STREAM_RECV; x <= XFER_STREAM_DATA; ++x) {
+      xfer_t xfer = (xfer_t)x;
+      long calls;
+      if (warmup_iters > 0) {
+        stream_batch(ucp_worker, ep, xfer, msg, len, chunk, is_sender, chunk * warmup_iters, &calls);
+      }
+
+      size_t total = std::max(len, std::max(STREAM_MIN_BYTES, std::min(len * measure_iters, STREAM_MAX_BYTES)));
+      total = (total + chunk - 1) / chunk * chunk;
+      double cpu = GetCpuTime();
+      double elapsed = stream_batch(ucp_worker, ep, xfer, msg, len, chunk, is_sender, total, &calls);
+      cpu = GetCpuTime() - cpu;
+
+      printf("%12lu %12s %12lu %10ld %12.1f %10.3f %7.1f\n",
+          len, xfer_names[xfer], total, calls, (double)total / calls, total / 1e9 / elapsed, cpu / elapsed * 100);
+    }
+  }
+}
+
+static ucp_mem_h mem_map(ucp_context_h ucp_context, void* address, size_t length) {
+  ucp_mem_map_params_t params;
+  params.field_mask = UCP_MEM_MAP_PARAM_FIELD_ADDRESS
+                    | UCP_MEM_MAP_PARAM_FIELD_LENGTH;
+  params.address = address;
+  params.length = length;
+  ucp_mem_h memh;
+  ucs_status_t status = ucp_mem_map(ucp_context, &params, &memh);
+  CHECK_UCS(status);
+  return memh;
+}
+
+/*
+ * Target side of the rkey exchange: send the address of `msg` and its packed
+ * rkey to the peer as one tag message.
+ */
+static void rma_expose(ucp_context_h ucp_context, ucp_worker_h ucp_worker, ucp_ep_h ep, char* msg, ucp_mem_h memh) {
+  void* rkey_buf;
+  size_t rkey_len;
+  ucs_status_t status = ucp_rkey_pack(ucp_context, memh, &rkey_buf, &rkey_len);
+  CHECK_UCS(status);
+
+  std::vector<char> info(sizeof(uint64_t) + rkey_len);
+  *(uint64_t*)info.data() = (uintptr_t)msg;
+  memcpy(info.data() + sizeof(uint64_t), rkey_buf, rkey_len);
+  ucp_rkey_buffer_release(rkey_buf);
+
+  ucp_request_param_t param;
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK;
+  param.cb.send = sweep_send_cb;
+  request_wait(ucp_worker, ucp_tag_send_nbx(ep, info.data(), info.size(), rkey_tag, &param), "rkey send");
+}
+
+/*
+ * Initiator side of the rkey exchange.
+ */
+static ucp_rkey_h rma_attach(ucp_worker_h ucp_worker, ucp_ep_h ep, uint64_t* address) {
+  ucp_tag_message_h msg_tag;
+  ucp_tag_recv_info_t info_tag;
+  progress_until(engine, [&] {
+    msg_tag = ucp_tag_probe_nb(ucp_worker, rkey_tag, tag_mask, 1, &info_tag);
+    return msg_tag != NULL;
+  });
+
+  ucp_request_param_t param;
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK;
+  param.cb.recv = sweep_recv_cb;
+  std::vector<char> info(info_tag.length);
+  request_wait(ucp_worker, ucp_tag_msg_recv_nbx(ucp_worker, info.data(), info.size(), msg_tag, &param),
+               "rkey receive");
+
+  *address = *(uint64_t*)info.data();
+  ucp_rkey_h rkey;
+  ucs_status_t status = ucp_ep_rkey_unpack(ep, info.data() + sizeof(uint64_t), &rkey);
+  CHECK_UCS(status);
+  return rkey;
+}
+
+/*
+ * Returns the time ucp_worker_flush_nbx takes to complete.
+ */
+static double worker_flush(ucp_worker_h ucp_worker) {
+  ucp_request_param_t param;
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK;
+  param.cb.send = sweep_send_cb;
+  double st = GetTime();
+  request_wait(ucp_worker, ucp_worker_flush_nbx(ucp_worker, &param), "flush");
+  return GetTime() - st;
+}
+
+/*
+ * Post one put or get and, with `wait`, wait for its local completion.
+ * Otherwise the request is released right away and completes on the next
+ * flush.
+ */
+static void rma_post(ucp_worker_h ucp_worker, ucp_ep_h ep, xfer_t xfer, char* msg, size_t len, uint64_t address,
+                     ucp_rkey_h rkey, bool wait) {
+  ucp_request_param_t param;
+  param.op_attr_mask = wait ? UCP_OP_ATTR_FIELD_CALLBACK : 0;
+  param.cb.send = sweep_send_cb;
+  ucs_status_ptr_t request = xfer == XFER_RMA_PUT ? ucp_put_nbx(ep, msg, len, address, rkey, &param)
+                                                  : ucp_get_nbx(ep, msg, len, address, rkey, &param);
+  if (wait) {
+    request_wait(ucp_worker, request, xfer_names[xfer]);
+  } else if (UCS_PTR_IS_ERR(request)) {
+    printf("UCP %s failed. (%s)\n", xfer_names[xfer], ucs_status_string(UCS_PTR_STATUS(request)));
+    exit(EXIT_FAILURE);
+  } else if (UCS_PTR_IS_PTR(request)) {
+    ucp_request_free(request);
+  }
+}
+
+/*
+ * One-sided put/get. Both sides map their message buffer with ucp_mem_map,
+ * unless -M already did, so registration is never measured; the client
+ * exposes its buffer and the server, which initiates, receives the address
+ * and rkey over the endpoint. For every sweep size the server measures the
+ * bandwidth of measure_iters operations completed by one
+ * ucp_worker_flush_nbx, the time of that flush alone, and the latency of
+ * single operations: a put followed by a flush (remote completion), a get
+ * until its data arrived. The client only progresses until the server
+ * acknowledges each step, since some transports need the target to progress
+ * RMA.
+ */
+static void run_rma(ucp_context_h ucp_context, ucp_worker_h ucp_worker, ucp_ep_h ep, char* msg, bool is_sender) {
+  ucp_mem_h memh = msg_memh ? msg_memh : mem_map(ucp_context, msg, sweep_max_len);
+
+  if (!is_sender) {
+    rma_expose(ucp_context, ucp_worker, ep, msg, memh);
+    printf("Serving %lu bytes for remote access\n", sweep_max_len);
+
+    ucp_request_param_t ack_param;
+    ack_param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK;
+    ack_param.cb.recv = sweep_recv_cb;
+    char ack;
+    for (size_t len = sweep_min_len; len <= sweep_max_len; len *= 2) {
+      for (int x = XFER_RMA_PUT; x <= XFER_RMA_GET; ++x) {
+        request_wait(ucp_worker, ucp_tag_recv_nbx(ucp_worker, &ack, sizeof(ack), ack_tag, tag_mask, &ack_param),
+                     "ack receive");
+      }
+    }
+  } else {
+    uint64_t address;
+    ucp_rkey_h rkey = rma_attach(ucp_worker, ep, &address);
+
+    double idle = 0;
+    for (int i = 0; i < measure_iters; ++i) {
+      idle += worker_flush(ucp_worker);
+    }
+    printf("Idle ucp_worker_flush_nbx: %.2f us\n", idle * 1e6 / measure_iters);
+    printf("%12s %10s %8s %10s %10s %10s\n", "size", "op", "iters", "lat(us)", "GB/s", "flush(us)");
+
+    for (size_t len = sweep_min_len; len <= sweep_max_len; len *= 2) {
+      for (int x = XFER_RMA_PUT; x <= XFER_RMA_GET; ++x) {
+        xfer_t xfer = (xfer_t)x;
+        for (int i = 0; i < warmup_iters; ++i) {
+          rma_post(ucp_worker, ep, xfer, msg, len, address, rkey, false);
+        }
+        worker_flush(ucp_worker);
+
+        double st = GetTime();
+        for (int i = 0; i < measure_iters; ++i) {
+          rma_post(ucp_worker, ep, xfer, msg, len, address, rkey, false);
+        }
+        double flush = worker_flush(ucp_worker);
+        double elapsed = GetTime() - st;
+
+        st = GetTime();
+        for (int i = 0; i < measure_iters; ++i) {
+          rma_post(ucp_worker, ep, xfer, msg, len, address, rkey, true);
+          if (xfer == XFER_RMA_PUT) worker_flush(ucp_worker);
+        }
+        double lat = (GetTime() - st) / measure_iters;
+
+        sweep_ack(ucp_worker, ep, 0, 1);
+        printf("%12lu %10s %8d %10.2f %10.3f %10.2f\n",
+            len, xfer_names[xfer], measure_iters, lat * 1e6, len * measure_iters / 1e9 / elapsed, flush * 1e6);
+      }
+    }
+    ucp_rkey_destroy(rkey);
+  }
+
+  if (memh != msg_memh) {
+    ucs_status_t status = ucp_mem_unmap(ucp_context, memh);
+    CHECK_UCS(status);
+  }
+}
+
+struct dt_layout;
+
+/*
+ * Pack or unpack state of the generic datatype, also used to pack by hand.
+ */
+struct dt_state {
+  const dt_layout* layout;
+  char* base;
+  size_t count;
+  bool busy;
+};
+
+/*
+ * Non-contiguous message layout of the datatype benchmark: `count` segments
+ * of `seg_size` bytes, `stride` bytes apart, like an array of structs with
+ * gaps between the fields that are sent. It is also the generic datatype's
+ * context; dt_batch has at most one send or receive in flight, so one
+ * preallocated state per direction saves an allocation per message.
+ */
+struct dt_layout {
+  size_t seg_size;
+  size_t stride;
+  dt_state pack_state, unpack_state;
+};
+
+/*
+ * Copy up to `len` bytes between the segments, starting at byte `offset` of
+ * the packed message, and `buf`. Returns the number of bytes copied.
+ */
+static size_t dt_copy(const dt_state* state, size_t offset, char* buf, size_t len, bool pack) {
+  const dt_layout* l = state->layout;
+  size_t seg = offset / l->seg_size;
+  size_t off = offset % l->seg_size;
+  size_t done = 0;
+  for (; done < len && seg < state->count; ++seg, off = 0) {
+    size_t n = std::min(l->seg_size - off, len - done);
+    char* p = state->base + seg * l->stride + off;
+    if (pack) {
+      memcpy(buf + done, p, n);
+    } else {
+      memcpy(p, buf + done, n);
+    }
+    done += n;
+  }
+  return done;
+}
+
+static void* dt_start(dt_state* state, const dt_layout* layout, void* buffer, size_t count) {
+  CHECK_COND(!state->busy);
+  state->layout = layout;
+  state->base = (char*)buffer;
+  state->count = count;
+  state->busy = true;
+  return state;
+}
+
+static void* dt_start_pack(void* context, const void* buffer, size_t count) {
+  dt_layout* layout = (dt_layout*)context;
+  return dt_start(&layout->pack_state, layout, (void*)buffer, count);
+}
+
+static void* dt_start_unpack(void* context, void* buffer, size_t count) {
+  dt_layout* layout = (dt_layout*)context;
+  return dt_start(&layout->unpack_state, layout, buffer, count);
+}
+
+static size_t dt_packed_size(void* state) {
+  dt_state* st = (dt_state*)state;
+  return st->layout->seg_size * st->count;
+}
+
+static size_t dt_pack(void* state, size_t offset, void* dest, size_t max_length) {
+  return dt_copy((dt_state*)state, offset, (char*)dest, max_length, true);
+}
+
+static ucs_status_t dt_unpack(void* state, size_t offset, const void* src, size_t length) {
+  size_t n = dt_copy((dt_state*)state, offset, (char*)src, length, false);
+  return n == length ? UCS_OK : UCS_ERR_MESSAGE_TRUNCATED;
+}
+
+static void dt_finish(void* state) {
+  ((dt_state*)state)->busy = false;
+}
+
+/*
+ * One datatype step: the server sends `iters` messages of the layout, the
+ * client receives them into the same layout and acknowledges the last one.
+ * XFER_DT_PACK gathers into `staging` by hand and sends it contiguous (and
+ * scatters on the client), XFER_DT_IOV passes one ucp_dt_iov_t per segment
+ * and XFER_DT_GENERIC passes `generic_dt`, whose callbacks do the copies.
+ */
+static double dt_batch(ucp_worker_h ucp_worker, ucp_ep_h ep, xfer_t xfer, char* msg, char* staging,
+                       const dt_layout& layout, size_t count, ucp_datatype_t generic_dt, bool is_sender, int iters) {
+  if (iters == 0) return 0;
+
+  std::vector<ucp_dt_iov_t> iov(count);
+  for (size_t i = 0; i < count; ++i) {
+    iov[i].buffer = msg + i * layout.stride;
+    iov[i].length = layout.seg_size;
+  }
+  dt_state state{&layout, msg, count, false};
+  size_t bytes = layout.seg_size * count;
+
+  ucp_request_param_t param;
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK
+                     | UCP_OP_ATTR_FIELD_DATATYPE;
+  void* buffer;
+  size_t buf_count;
+  if (xfer == XFER_DT_IOV) {
+    param.datatype = ucp_dt_make_iov();
+    buffer = iov.data();
+    buf_count = count;
+  } else if (xfer == XFER_DT_GENERIC) {
+    param.datatype = generic_dt;
+    buffer = msg;
+    buf_count = count;
+  } else {
+    param.datatype = ucp_dt_make_contig(1);
+    buffer = staging;
+    buf_count = bytes;
+  }
+
+  double st = GetTime();
+  if (is_sender) {
+    ucp_request_param_t ack_param;
+    ack_param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK;
+    ack_param.cb.recv = sweep_recv_cb;
+    char ack;
+    ucs_status_ptr_t ack_req = ucp_tag_recv_nbx(ucp_worker, &ack, sizeof(ack), ack_tag, tag_mask, &ack_param);
+
+    param.cb.send = sweep_send_cb;
+    for (int i = 0; i < iters; ++i) {
+      if (xfer == XFER_DT_PACK) dt_copy(&state, 0, staging, bytes, true);
+      request_wait(ucp_worker, ucp_tag_send_nbx(ep, buffer, buf_count, tag, &param), "send");
+    }
+    request_wait(ucp_worker, ack_req, "ack receive");
+  } else {
+    param.cb.recv = sweep_recv_cb;
+    for (int i = 0; i < iters; ++i) {
+      request_wait(ucp_worker, ucp_tag_recv_nbx(ucp_worker, buffer, buf_count, tag, tag_mask, &param), "receive");
+      if (xfer == XFER_DT_PACK) dt_copy(&state, 0, staging, bytes, false);
+    }
+    sweep_ack(ucp_worker, ep, 0, 1);
+  }
+  return GetTime() - st;
+}
+
+/*
+ * Non-contiguous sends: the same segments as one contiguous message packed by
+ * hand, as an IOV datatype and as a generic datatype, for every segment size
+ * (powers of 4 up to DT_MAX_SEG) and count in dt_seg_counts. Segments are
+ * separated by a gap as large as the segment; layouts that do not fit in the
+ * message buffer are skipped.
+ */
+static void run_dt(ucp_worker_h ucp_worker, ucp_ep_h ep, char* msg, bool is_sender) {
+  printf("%12s %8s %12s %12s %8s %10s %7s\n", "seg size", "segs", "bytes", "method", "iters", "GB/s", "cpu%");
+
+  char* staging = (char*)malloc(sweep_max_len / 2);
+  ucp_generic_dt_ops_t ops;
+  ops.start_pack = dt_start_pack;
+  ops.start_unpack = dt_start_unpack;
+  ops.packed_size = dt_packed_size;
+  ops.pack = dt_pack;
+  ops.unpack = dt_unpack;
+  ops.finish = dt_finish;
+
+  size_t first_seg = 1;
+  while (first_seg < std::max(sweep_min_len, sizeof(uint64_t))) first_seg *= 4;
+  for (size_t seg = first_seg; seg <= std::min(sweep_max_len, DT_MAX_SEG); seg *= 4) {
+    dt_layout layout;
+    layout.seg_size = seg;
+    layout.stride = 2 * seg;
+    layout.pack_state.busy = layout.unpack_state.busy = false;
+    ucp_datatype_t generic_dt;
+    ucs_status_t status = ucp_dt_create_generic(&ops, &layout, &generic_dt);
+    CHECK_UCS(status);
+
+    for (size_t count : dt_seg_counts) {
+      if (count * layout.stride > sweep_max_len) break;
+      for (int x = XFER_DT_PACK; x <= XFER_DT_GENERIC; ++x) {
+        xfer_t xfer = (xfer_t)x;
+        dt_batch(ucp_worker, ep, xfer, msg, staging, layout, count, generic_dt, is_sender, warmup_iters);
+
+        double cpu = GetCpuTime();
+        double elapsed = dt_batch(ucp_worker, ep, xfer, msg, staging, layout, count, generic_dt, is_sender,
+                                  measure_iters);
+        cpu = GetCpuTime() - cpu;
+
+        size_t bytes = seg * count;
+        printf("%12lu %8lu %12lu %12s %8d %10.3f %7.1f\n", seg, count, bytes, xfer_names[xfer], measure_iters,
+            bytes * measure_iters / 1e9 / elapsed, cpu / elapsed * 100);
+      }
+    }
+    ucp_dt_destroy(generic_dt);
+  }
+  free(staging);
+}
+
+/*
+ * Transfer methods run for every sweep size, in order. The multi-client
+ * server walks the same list, so its clients need no special mode.
+ */
+static std::vector<xfer_t> sweep_xfers() {
+  std::vector<xfer_t> xfers;
+  if (sweep_apis & UCS_BIT(API_TAG)) {
+    if (recv_mode != RECV_MODE_RING) xfers.push_back(XFER_TAG_PROBE);
+    if (recv_mode != RECV_MODE_PROBE) xfers.push_back(XFER_TAG_RING);
+  }
+  if (sweep_apis & UCS_BIT(API_AM)) {
+    xfers.push_back(XFER_AM_EAGER);
+    xfers.push_back(XFER_AM_RNDV);
+  }
+  return xfers;
+}
+
+/*
+ * Walk message sizes in powers of two and print a latency/bandwidth table.
+ * Both sides must be started with the same sweep options. Every size is run
+ * once per selected API and tag receive mode (RECV_MODE_BOTH), AM once with
+ * forced eager and once with forced rendezvous, so the rows can be compared.
+ */
+static void run_sweep(ucp_context_h ucp_context, ucp_worker_h ucp_worker, ucp_ep_h ep, char* msg, bool is_sender) {
+  std::vector<xfer_t> xfers = sweep_xfers();
+
+  printf("Progress engine: %s\n", progress_mode_names[progress_mode]);
+  if (!xfers.empty()) {
+    printf("%12s %10s %8s %10s %10s %10s %10s %10s %7s %9s\n",
+        "size", "method", "iters", "min(us)", "avg(us)", "p50(us)", "p99(us)", "GB/s", "cpu%", "wake/msg");
+  }
+
+  std::vector<double> samples;
+  for (size_t len = sweep_min_len; len <= sweep_max_len && !xfers.empty(); len *= 2) {
+    for (xfer_t xfer : xfers) {
+      samples.clear();
+      sweep_batch(ucp_worker, ep, msg, len, is_sender, xfer, warmup_iters, NULL);
+
+      unsigned long wakeups = engine->wakeups;
+      double cpu = GetCpuTime();
+      double elapsed = sweep_batch(ucp_worker, ep, msg, len, is_sender, xfer, measure_iters, &samples);
+      cpu = GetCpuTime() - cpu;
+      wakeups = engine->wakeups - wakeups;
+
+      lat_stats st = get_lat_stats(samples);
+      printf("%12lu %10s %8d %10.2f %10.2f %10.2f %10.2f %10.3f %7.1f %9.2f\n",
+          len, xfer_names[xfer], measure_iters, st.min * 1e6, st.avg * 1e6, st.p50 * 1e6, st.p99 * 1e6,
+          len * measure_iters / 1e9 / elapsed, cpu / elapsed * 100, (double)wakeups / measure_iters);
+    }
+  }
+  if (sweep_apis & UCS_BIT(API_STREAM)) {
+    run_stream(ucp_worker, ep, msg, is_sender);
+  }
+  if (sweep_apis & UCS_BIT(API_RMA)) {
+    run_rma(ucp_context, ucp_worker, ep, msg, is_sender);
+  }
+  if (sweep_apis & UCS_BIT(API_DT)) {
+    run_dt(ucp_worker, ep, msg, is_sender);
+  }
+  progress_engine_print(engine);
+}
+
+/*
+ * Create a worker and its progress engine.
+ */
+static void init_worker(ucp_context_h ucp_context, ucp_worker_h* ucp_worker, progress_engine* pe) {
+  ucs_status_t status;
+
+  /*
+   * Setup UCP worker parameters
+   */
+  ucp_worker_params_t worker_params;
+  memset(&worker_params, 0, sizeof(worker_params));
+  worker_params.field_mask = UCP_WORKER_PARAM_FIELD_THREAD_MODE;
+  worker_params.thread_mode = UCS_THREAD_MODE_SINGLE;
+
+  /*
+   * Create UCP worker
+   */
+  status = ucp_worker_create(ucp_context, &worker_params, ucp_worker);
+  CHECK_UCS(status);
+
+  int worker_fd = -1;
+  if (progress_mode != PROGRESS_MODE_POLL) {
+    status = ucp_worker_get_efd(*ucp_worker, &worker_fd);
+    CHECK_UCS(status);
+  }
+  progress_engine_init(pe, progress_mode, *ucp_worker, worker_progress_cb,
+                       worker_arm_cb, worker_wait_cb, worker_fd);
+}
+
+/*
+ * One batch on a data worker: stream `iters` messages to each of its clients
+ * through a send window per client, then collect one ack per client. Acks are
+ * matched by tag only, so per-client time ends at the client's last send
+ * completion.
+ */
+static void multi_send_batch(data_worker* dw, xfer_t xfer, size_t len, int iters, bool record) {
+  if (iters == 0) return;
+
+  ucp_request_param_t ack_param;
+  ack_param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK;
+  ack_param.cb.recv = sweep_recv_cb;
+
+  std::vector<char> acks(dw->conns.size());
+  std::vector<ucs_status_ptr_t> ack_reqs(dw->conns.size());
+  for (size_t i = 0; i < dw->conns.size(); ++i) {
+    ack_reqs[i] = ucp_tag_recv_nbx(dw->worker, &acks[i], sizeof(char), ack_tag, tag_mask, &ack_param);
+  }
+
+  dw->start = GetTime();
+  for (client_conn* conn : dw->conns) {
+    conn->samples.clear();
+    window_start(&conn->win, conn->ep, xfer, dw->msg, len, iters, record ? &conn->samples : NULL);
+  }
+  progress_until(engine, [&] {
+    for (client_conn* conn : dw->conns) {
+      if (conn->win.completed < iters) return false;
+    }
+    return true;
+  });
+  for (client_conn* conn : dw->conns) {
+    conn->end = conn->win.last_completion;
+  }
+
+  for (ucs_status_ptr_t req : ack_reqs) {
+    request_wait(dw->worker, req, "ack receive");
+  }
+}
+
+static void print_multi_rows(xfer_t xfer, size_t len) {
+  double start = data_workers[0].start, end = 0;
+  for (data_worker& dw : data_workers) {
+    for (client_conn* conn : dw.conns) {
+      lat_stats st = get_lat_stats(conn->samples);
+      printf("%12lu %10s %6ld %8d %10.2f %10.2f %10.2f %10.2f %10.3f\n",
+          len, xfer_names[xfer], conn - client_conns.data(), measure_iters, st.min * 1e6, st.avg * 1e6, st.p50 * 1e6, st.p99 * 1e6,
+          len * measure_iters / 1e9 / (conn->end - dw.start));
+      end = std::max(end, conn->end);
+    }
+    start = std::min(start, dw.start);
+  }
+  printf("%12lu %10s %6s %8d %10s %10s %10s %10s %10.3f\n",
+      len, xfer_names[xfer], "all", measure_iters, "-", "-", "-", "-",
+      len * measure_iters * client_conns.size() / 1e9 / (end - start));
+}
+
+static void* data_worker_thread(void* arg) {
+  data_worker* dw = (data_worker*)arg;
+  engine = &dw->engine;
+
+  std::vector<xfer_t> xfers = sweep_xfers();
+  for (size_t len = sweep_min_len; len <= sweep_max_len; len *= 2) {
+    for (xfer_t xfer : xfers) {
+      multi_send_batch(dw, xfer, len, warmup_iters, false);
+      pthread_barrier_wait(&data_barrier);
+      multi_send_batch(dw, xfer, len, measure_iters, true);
+      pthread_barrier_wait(&data_barrier);
+      if (dw->index == 0) print_multi_rows(xfer, len);
+      pthread_barrier_wait(&data_barrier);
+    }
+  }
+
+  for (client_conn* conn : dw->conns) {
+    ep_close(dw->worker, conn->ep);
+  }
+  return NULL;
+}
+
+/*
+ * Accept every connection request and spread the endpoints round-robin over
+ * num_threads data workers, each progressed by its own thread. Prints
+ * per-client and aggregate bandwidth for every sweep size.
+ */
+static void run_multi_server(ucp_context_h ucp_context, const std::vector<ucp_conn_request_h>& reqs, char* msg) {
+  ucs_status_t status;
+  int nthreads = std::min(num_threads, num_clients);
+
+  data_workers.resize(nthreads);
+  for (int i = 0; i < nthreads; ++i) {
+    data_workers[i].index = i;
+    data_workers[i].msg = msg;
+    init_worker(ucp_context, &data_workers[i].worker, &data_workers[i].engine);
+  }
+
+  client_conns.resize(num_clients);
+  for (int i = 0; i < num_clients; ++i) {
+    data_worker& dw = data_workers[i % nthreads];
+
+    ucp_ep_params_t ep_params;
+    ep_params.field_mask = UCP_EP_PARAM_FIELD_CONN_REQUEST;
+    ep_params.conn_request = reqs[i];
+    status = ucp_ep_create(dw.worker, &ep_params, &client_conns[i].ep);
+    CHECK_UCS(status);
+    dw.conns.push_back(&client_conns[i]);
+  }
+
+  printf("Serving %d clients on %d data workers.\n", num_clients, nthreads);
+  printf("%12s %10s %6s %8s %10s %10s %10s %10s %10s\n",
+      "size", "method", "client", "iters", "min(us)", "avg(us)", "p50(us)", "p99(us)", "GB/s");
+
+  pthread_barrier_init(&data_barrier, NULL, nthreads);
+  for (data_worker& dw : data_workers) {
+    pthread_create(&dw.thread, NULL, data_worker_thread, &dw);
+  }
+  for (data_worker& dw : data_workers) {
+    pthread_join(dw.thread, NULL);
+  }
+  pthread_barrier_destroy(&data_barrier);
+
+  for (data_worker& dw : data_workers) {
+    progress_engine_print(&dw.engine);
+    progress_engine_cleanup(&dw.engine);
+    ucp_worker_destroy(dw.worker);
+  }
+}
+
+/*
+ * Bind [addr, addr + len) to NUMA node `node`, moving pages already there.
+ * Uses the raw syscall so no libnuma is needed.
+ */
+static void bind_node(void* addr, size_t len, int node) {
+  unsigned long mask[16] = {0};
+  CHECK_COND(node >= 0 && node < (int)(sizeof(mask) * 8));
+  mask[node / 64] |= 1UL << (node % 64);
+  if (syscall(SYS_mbind, addr, len, MPOL_BIND, mask, sizeof(mask) * 8 + 1, MPOL_MF_MOVE) != 0) {
+    printf("mbind to node %d failed. (%s)\n", node, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
+
+static int local_node() {
+  unsigned cpu, node;
+  CHECK_COND(syscall(SYS_getcpu, &cpu, &node, NULL) == 0);
+  return node;
+}
+
+/*
+ * Read one byte of every 4 KiB page of the buffer in a scattered order and
+ * return the average time per access. With 4 KiB pages nearly every access
+ * misses the TLB; huge pages show how much of the cost that is.
+ */
+static double page_walk(const char* addr, size_t len) {
+  size_t pages = len / 4096;
+  if (pages < 2) return 0;
+  size_t step = 1000003 % pages;
+  while (std::gcd(step, pages) != 1) ++step;
+
+  size_t idx = 0;
+  uint64_t sum = 0;
+  double st = GetTime();
+  for (size_t i = 0; i < pages; ++i) {
+    idx = (idx + step) % pages;
+    sum += *(volatile const char*)&addr[idx * 4096];
+  }
+  double sec = GetTime() - st;
+  read_sink = sum;
+  return sec / pages;
+}
+
+/*
+ * Allocate the message buffer as selected by -M and -N. Allocation, first
+ * touch and registration are timed and reported separately, so the
+ * benchmarks only see the steady state (except with ALLOC_MALLOC, where UCP
+ * registers on first use). Sets msg_memh if the buffer is registered.
+ */
+static char* alloc_msg(ucp_context_h ucp_context, size_t len, size_t* alloc_len) {
+  ucs_status_t status;
+  char* addr;
+  double st = GetTime(), alloc_sec, reg_sec = 0;
+
+  if (alloc_mode == ALLOC_UCP) {
+    ucp_mem_map_params_t params;
+    params.field_mask = UCP_MEM_MAP_PARAM_FIELD_ADDRESS
+                      | UCP_MEM_MAP_PARAM_FIELD_LENGTH
+                      | UCP_MEM_MAP_PARAM_FIELD_FLAGS;
+    params.address = NULL;
+    params.length = len;
+    params.flags = UCP_MEM_MAP_ALLOCATE;
+    status = ucp_mem_map(ucp_context, &params, &msg_memh);
+    CHECK_UCS(status);
+
+    ucp_mem_attr_t attr;
+    attr.field_mask = UCP_MEM_ATTR_FIELD_ADDRESS
+                    | UCP_MEM_ATTR_FIELD_LENGTH;
+    status = ucp_mem_query(msg_memh, &attr);
+    CHECK_UCS(status);
+    addr = (char*)attr.address;
+    *alloc_len = attr.length;
+  } else if (alloc_mode == ALLOC_HUGE_2M || alloc_mode == ALLOC_HUGE_1G) {
+    int page_shift = alloc_mode == ALLOC_HUGE_2M ? 21 : 30;
+    size_t page = 1UL << page_shift;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | page_shift << MAP_HUGE_SHIFT;
+    *alloc_len = (len + page - 1) / page * page;
+    addr = (char*)mmap(NULL, *alloc_len, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (addr == MAP_FAILED) {
+      printf("mmap of %lu bytes in %s pages failed. (%s) Check /sys/kernel/mm/hugepages.\n",
+          *alloc_len, alloc_mode_names[alloc_mode], strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    *alloc_len = (len + 4095) / 4096 * 4096;
+    addr = (char*)aligned_alloc(4096, *alloc_len);
+    CHECK_COND(addr != NULL);
+  }
+  alloc_sec = GetTime() - st;
+
+  int node = numa_local ? local_node() : numa_node;
+  if (node >= 0) {
+    bind_node(addr, *alloc_len, node);
+  }
+
+  st = GetTime();
+  memset(addr, 0, *alloc_len);
+  double touch_sec = GetTime() - st;
+
+  if (alloc_mode != ALLOC_MALLOC && alloc_mode != ALLOC_UCP) {
+    st = GetTime();
+    msg_memh = mem_map(ucp_context, addr, *alloc_len);
+    reg_sec = GetTime() - st;
+  }
+
+  printf("Message buffer: %s, %lu bytes", alloc_mode_names[alloc_mode], *alloc_len);
+  if (node >= 0) printf(", node %d", node);
+  printf("\n%12s %12s %12s %12s %14s\n", "alloc(ms)", "touch(ms)", "touch(GB/s)", "reg(ms)", "page walk(ns)");
+  printf("%12.2f %12.2f %12.3f %12s %14.1f\n", alloc_sec * 1e3, touch_sec * 1e3, *alloc_len / 1e9 / touch_sec,
+      alloc_mode == ALLOC_MALLOC ? "lazy" : alloc_mode == ALLOC_UCP ? "in alloc" : std::to_string(reg_sec * 1e3).c_str(),
+      page_walk(addr, *alloc_len) * 1e9);
+  return addr;
+}
+
+static void free_msg(ucp_context_h ucp_context, char* addr, size_t alloc_len) {
+  if (msg_memh) {
+    ucs_status_t status = ucp_mem_unmap(ucp_context, msg_memh);
+    CHECK_UCS(status);
+    msg_memh = NULL;
+  }
+  if (alloc_mode == ALLOC_HUGE_2M || alloc_mode == ALLOC_HUGE_1G) {
+    munmap(addr, alloc_len);
+  } else if (alloc_mode != ALLOC_UCP) {
+    free(addr);
+  }
+}
+
+/*
+ * Parse a comma-separated list of api_names into a bit mask.
+ */
+static bool parse_apis(const char* str, unsigned* apis) {
+  std::string list(str);
+  *apis = 0;
+  size_t pos = 0;
+  while (pos <= list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos) end = list.size();
+    std::string name = list.substr(pos, end - pos);
+    int i = 0;
+    while (i < API_COUNT && name != api_names[i]) ++i;
+    if (i == API_COUNT) return false;
+    *apis |= UCS_BIT(i);
+    pos = end + 1;
+  }
+  return true;
+}
+
+static void print_usage(const char* prog) {
+  printf("Usage:\n");
+  printf("  server: %s [options]\n", prog);
+  printf("  client: %s [options] [server]\n", prog);
+  printf("Options (pass the same ones on both sides):\n");
+  printf("  -s         sweep message sizes instead of looping on one size\n");
+  printf("  -b <size>  smallest sweep message size (default: %lu)\n", sweep_min_len);
+  printf("  -e <size>  largest sweep message size (default: %lu)\n", sweep_max_len);
+  printf("  -w <n>     warmup iterations per size (default: %d)\n", warmup_iters);
+  printf("  -n <n>     measured iterations per size (default: %d)\n", measure_iters);
+  printf("  -W <n>     number of sends kept in flight by the server (default: %d)\n", send_window);
+  printf("  -r <mode>  sweep receive mode: probe, ring or both (default: %s)\n", recv_mode_names[recv_mode]);
+  printf("  -R <n>     depth of the pre-posted receive ring (default: %d)\n", recv_ring_depth);
+  printf("  -M <alloc> message buffer: malloc, map (malloc + ucp_mem_map), ucp (UCP_MEM_MAP_ALLOCATE),\n");
+  printf("             huge2m or huge1g (mmap with MAP_HUGETLB + ucp_mem_map) (default: %s)\n",
+      alloc_mode_names[alloc_mode]);
+  printf("  -N <node>  bind the message buffer to a NUMA node, or \"local\" for the node of this CPU\n");
+  printf("  -a <apis>  comma-separated sweep APIs: tag, am, stream, rma, dt (default: tag)\n");
+  printf("  -c <n>     number of clients the server waits for; needs -s (default: %d)\n", num_clients);
+  printf("  -T <n>     server data worker threads for multiple clients (default: %d)\n", num_threads);
+  printf("  -p <mode>  progress engine: poll, wait, eventfd or adaptive (default: %s)\n",
+      progress_mode_names[progress_mode]);
+  printf("Sizes accept K/M/G suffixes.\n");
+}
+
 int main(int argc, char** argv) {
   /* args setup */
   char* server_name = NULL;
-  if (argc == 1) {
-    // server
-  } else if (argc == 2) {
+  int c;
+  while ((c = getopt(argc, argv, "sb:e:w:n:W:r:R:a:M:N:c:T:p:h")) != -1) {
+    switch (c) {
+      case 's':
+        sweep_mode = true;
+        break;
+      case 'b':
+        sweep_min_len = parse_size(optarg);
+        break;
+      case 'e':
+        sweep_max_len = parse_size(optarg);
+        break;
+      case 'w':
+        warmup_iters = atoi(optarg);
+        break;
+      case 'n':
+        measure_iters = atoi(optarg);
+        break;
+      case 'W':
+        send_window = atoi(optarg);
+        break;
+      case 'r':
+        if (!strcmp(optarg, "probe")) {
+          recv_mode = RECV_MODE_PROBE;
+        } else if (!strcmp(optarg, "ring")) {
+          recv_mode = RECV_MODE_RING;
+        } else if (!strcmp(optarg, "both")) {
+          recv_mode = RECV_MODE_BOTH;
+        } else {
+          print_usage(argv[0]);
+          return 0;
+        }
+        break;
+      case 'R':
+        recv_ring_depth = atoi(optarg);
+        break;
+      case 'a':
+        if (!parse_apis(optarg, &sweep_apis)) {
+          print_usage(argv[0]);
+          return 0;
+        }
+        break;
+      case 'M': {
+        int i = 0;
+        while (i <= ALLOC_HUGE_1G && strcmp(optarg, alloc_mode_names[i])) ++i;
+        if (i > ALLOC_HUGE_1G) {
+          print_usage(argv[0]);
+          return 0;
+        }
+        alloc_mode = (alloc_mode_t)i;
+        break;
+      }
+      case 'N':
+        if (!strcmp(optarg, "local")) {
+          numa_local = true;
+        } else {
+          numa_node = atoi(optarg);
+        }
+        break;
+      case 'c':
+        num_clients = atoi(optarg);
+        break;
+      case 'T':
+        num_threads = atoi(optarg);
+        break;
+      case 'p':
+        if (!parse_progress_mode(optarg, &progress_mode)) {
+          print_usage(argv[0]);
+          return 0;
+        }
+        break;
+      default:
+        print_usage(argv[0]);
+        return 0;
+    }
+  }
+  if (sweep_min_len == 0 || sweep_max_len < sweep_min_len || warmup_iters < 0 || measure_iters <= 0 ||
+      send_window <= 0 || recv_ring_depth <= 0 || num_clients <= 0 || num_threads <= 0 ||
+      (num_clients > 1 && !sweep_mode) || (sweep_apis != UCS_BIT(API_TAG) && (!sweep_mode || num_clients > 1))) {
+    print_usage(argv[0]);
+    return 0;
+  }
+  if (optind + 1 == argc) {
     // client
-    server_name = argv[1];
-  } else {
-    printf("Usage:\n");
-    printf("  server: %s\n", argv[0]);
-    printf("  client: %s [server]\n", argv[0]);
+    server_name = argv[optind];
+  } else if (optind != argc) {
+    print_usage(argv[0]);
     return 0;
   }
   const char* server_port = "13337";
@@ -82,8 +1516,27 @@ int main(int argc, char** argv) {
                         | UCP_PARAM_FIELD_REQUEST_SIZE
                         | UCP_PARAM_FIELD_REQUEST_INIT;
   ucp_params.features = UCP_FEATURE_TAG;
+  if (sweep_apis & UCS_BIT(API_AM)) {
+    ucp_params.features |= UCP_FEATURE_AM;
+  }
+  if (sweep_apis & UCS_BIT(API_STREAM)) {
+    ucp_params.features |= UCP_FEATURE_STREAM;
+  }
+  if (sweep_apis & UCS_BIT(API_RMA)) {
+    ucp_params.features |= UCP_FEATURE_RMA;
+  }
+  if (progress_mode != PROGRESS_MODE_POLL) {
+    ucp_params.features |= UCP_FEATURE_WAKEUP;
+  }
   ucp_params.request_size = sizeof(my_context);
   ucp_params.request_init = request_init;
+  if (num_clients > 1) {
+    /*
+     * The data workers share the context (and its registrations) across threads
+     */
+    ucp_params.field_mask |= UCP_PARAM_FIELD_MT_WORKERS_SHARED;
+    ucp_params.mt_workers_shared = 1;
+  }
 
   /*
    * Setup UCP configuration
@@ -105,26 +1558,31 @@ int main(int argc, char** argv) {
   ucp_config_print(config, stdout, NULL, UCS_CONFIG_PRINT_CONFIG);
   ucp_config_release(config);
 
-  /*
-   * Setup UCP worker parameters
-   */
-  ucp_worker_params_t worker_params;
-  memset(&worker_params, 0, sizeof(worker_params));
-  worker_params.field_mask = UCP_WORKER_PARAM_FIELD_THREAD_MODE;
-  worker_params.thread_mode = UCS_THREAD_MODE_SINGLE;
-
   /*
    * Create UCP worker
    */
   ucp_worker_h ucp_worker;
-  status = ucp_worker_create(ucp_context, &worker_params, &ucp_worker);
-  CHECK_UCS(status);
+  progress_engine main_engine;
+  init_worker(ucp_context, &ucp_worker, &main_engine);
+  engine = &main_engine;
 
-  const ucp_tag_t tag = 0x1337A880;
-  const ucp_tag_t tag_mask = 0xFFFFFFFF;
+  if (sweep_apis & UCS_BIT(API_AM)) {
+    ucp_am_handler_param_t am_param;
+    am_param.field_mask = UCP_AM_HANDLER_PARAM_FIELD_ID
+                        | UCP_AM_HANDLER_PARAM_FIELD_FLAGS
+                        | UCP_AM_HANDLER_PARAM_FIELD_CB
+                        | UCP_AM_HANDLER_PARAM_FIELD_ARG;
+    am_param.id = am_id;
+    am_param.flags = UCP_AM_FLAG_WHOLE_MSG;
+    am_param.cb = am_recv_handler;
+    am_param.arg = &am_inbox;
+    status = ucp_worker_set_am_recv_handler(ucp_worker, &am_param);
+    CHECK_UCS(status);
+  }
 
-  size_t msg_len = 1L * 1024 * 1024 * 1024;
-  char* msg = (char*)malloc(msg_len);
+  size_t msg_len = sweep_mode ? sweep_max_len : 1L * 1024 * 1024 * 1024;
+  size_t msg_alloc_len;
+  char* msg = alloc_msg(ucp_context, msg_len, &msg_alloc_len);
 
   if (server_name) {
     /*
@@ -160,6 +1618,12 @@ int main(int argc, char** argv) {
 
     freeaddrinfo(res);
 
+    if (sweep_mode) {
+      run_sweep(ucp_context, ucp_worker, server_ep, msg, false);
+      ep_close(ucp_worker, server_ep);
+      goto cleanup;
+    }
+
     ucp_tag_message_h msg_tag;
     ucp_tag_recv_info_t info_tag;
     my_context* request;
@@ -171,11 +1635,10 @@ int main(int argc, char** argv) {
       /*
        * Probe message to receive
        */
-      while (true) {
+      progress_until(engine, [&] {
         msg_tag = ucp_tag_probe_nb(ucp_worker, tag, tag_mask, 1, &info_tag);
-        if (msg_tag != NULL) break;
-        ucp_worker_progress(ucp_worker);
-      }
+        return msg_tag != NULL;
+      });
 
       /*
        * Post non-blocking receive
@@ -186,9 +1649,7 @@ int main(int argc, char** argv) {
         exit(EXIT_FAILURE);
       } else if (UCS_PTR_IS_PTR(request)) {
         printf("Polling UCP recv completion...\n");
-        while (request->completed == 0) {
-          ucp_worker_progress(ucp_worker);
-        }
+        progress_until(engine, [&] { return request->completed != 0; });
         request->completed = 0;
         ucp_request_free(request);
       } else {
@@ -239,8 +1700,16 @@ int main(int argc, char** argv) {
 
     freeaddrinfo(res);
 
-    while (lc.reqs.size() == 0) {
-      ucp_worker_progress(ucp_worker);
+    progress_until(engine, [&] { return lc.reqs.size() >= (size_t)num_clients; });
+
+    if (num_clients > 1) {
+      for (size_t i = num_clients; i < lc.reqs.size(); ++i) {
+        status = ucp_listener_reject(listener, lc.reqs[i]);
+        CHECK_UCS(status);
+      }
+      run_multi_server(ucp_context, lc.reqs, msg);
+      ucp_listener_destroy(listener);
+      goto cleanup;
     }
 
     printf("%ld connection requests received. Only accept the first one.\n", lc.reqs.size());
@@ -261,10 +1730,36 @@ int main(int argc, char** argv) {
     status = ucp_ep_create(ucp_worker, &ep_params, &client_ep);
     CHECK_UCS(status);
 
+    if (sweep_mode) {
+      run_sweep(ucp_context, ucp_worker, client_ep, msg, true);
+      ep_close(ucp_worker, client_ep);
+      ucp_listener_destroy(listener);
+      goto cleanup;
+    }
+
+    double st, et;
+
+    if (send_window > 1) {
+      /*
+       * Keep send_window sends in flight forever and report each completion
+       */
+      send_window_t win;
+      long reported = 0;
+      st = GetTime();
+      window_start(&win, client_ep, XFER_TAG_PROBE, msg, msg_len, -1, NULL);
+      while (true) {
+        progress_until(engine, [&] { return win.completed > reported; });
+        for (; reported < win.completed; ++reported) {
+          et = GetTime();
+          printf("[%ld] %f s, %f GB/s (window %d)\n", reported, et - st, msg_len / 1e9 / (et - st), send_window);
+          st = et;
+        }
+      }
+    }
+
     my_context ctx;
     ucp_request_param_t send_param;
     ucs_status_ptr_t status;
-    double st, et;
 
     ctx.completed = 0;
 
@@ -287,9 +1782,7 @@ int main(int argc, char** argv) {
         printf("UCP sent immediately. Callback will not be called.\n");
       } else if (UCS_PTR_IS_PTR(status)) {
         printf("Polling UCP send completion...\n");
-        while (ctx.completed == 0) {
-          ucp_worker_progress(ucp_worker);
-        }
+        progress_until(engine, [&] { return ctx.completed != 0; });
         ctx.completed = 0;
         ucp_request_free(status);
       } else {
@@ -301,5 +1794,11 @@ int main(int argc, char** argv) {
     }
   }
 
+cleanup:
+  free_msg(ucp_context, msg, msg_alloc_len);
+  progress_engine_cleanup(&main_engine);
+  ucp_worker_destroy(ucp_worker);
+  ucp_cleanup(ucp_context);
+
   return 0;
 }
@@ -2,133 +2,398 @@
 #include <cstdint>
 #include <cstring>
 #include <cassert>
+#include <vector>
+#include <pthread.h>
+
+#include <string>
 
 #include <uct/api/uct.h>
+#include <ucs/time/time.h>
 
 #include "util.h"
+#include "rcache.h"
+#include "rxpool.h"
+#include "packer.h"
+#include "sched.h"
+#include "rpc.h"
+#include "swtm.h"
 
 enum func_am_t {
   FUNC_AM_SHORT,
   FUNC_AM_BCOPY,
   FUNC_AM_ZCOPY
 };
+static const char* func_am_names[] = {"short", "bcopy", "zcopy"};
+
+enum bench_t {
+  BENCH_SINGLE,
+  BENCH_RATE,
+  BENCH_PINGPONG,
+  BENCH_RMA,
+  BENCH_ATOMIC,
+  BENCH_RCACHE,
+  BENCH_IOV,
+  BENCH_PACKER,
+  BENCH_SCHED,
+  BENCH_RPC,
+  BENCH_TAG,
+  BENCH_FLUSH,
+  BENCH_PROBE     /* transport ranking, see select_transports */
+};
+static const char* bench_names[] = {"single", "rate", "pingpong", "rma", "atomic", "rcache", "iov", "packer", "sched", "rpc", "tag", "flush", "probe"};
+
+enum rma_op_t {
+  RMA_PUT_SHORT,
+  RMA_PUT_BCOPY,
+  RMA_PUT_ZCOPY,
+  RMA_GET_ZCOPY,
+  RMA_AM_ZCOPY    /* two-sided baseline */
+};
+static const char* rma_op_names[] = {"put_short", "put_bcopy", "put_zcopy", "get_zcopy", "am_zcopy"};
+
+enum iov_send_t {
+  IOV_BCOPY,      /* gather into the bounce buffer in the packer */
+  IOV_GATHER,     /* one uct_iov_t per fragment */
+  IOV_STRIDED     /* one uct_iov_t with count = fragments */
+};
+static const char* iov_send_names[] = {"bcopy", "gather", "strided"};
 
-struct recv_desc_t {
-  int is_uct_desc;
+enum atomic_kind_t {
+  ATOMIC_ADD,     /* post, no result */
+  ATOMIC_FADD,
+  ATOMIC_CSWAP
 };
+static const char* atomic_kind_names[] = {"add", "fadd", "cswap"};
 
 struct bcopy_args {
   char               *data;
   size_t              len;
+  size_t              nt_threshold;  /* see copy_sized */
 };
 
 struct zcopy_args {
   uct_completion_t    uct_comp;
-  uct_md_h            md;
-  uct_mem_h           memh;
+  rcache             *cache;
+  rcache_region      *region;   /* NULL if no memory handle is needed */
+};
+
+/*
+ * A message of `nfrags` fragments of `frag_size` bytes, `stride` bytes apart,
+ * behind a `header_len` byte header.
+ */
+struct gather_args {
+  const char         *header;
+  size_t              header_len;
+  const char         *base;
+  size_t              frag_size;
+  size_t              stride;
+  int                 nfrags;
+  size_t              nt_threshold;  /* see copy_sized */
+};
+
+struct tl_desc {
+  std::string tl_name;
+  std::string dev_name;
+};
+
+struct progress_arg {
+  uct_worker_h worker;
+  uct_iface_h iface;
+};
+
+/*
+ * Everything one thread needs to talk to its peer: its own async context,
+ * worker, iface and endpoint.
+ */
+struct transport {
+  int index;
+  int cpu;                // -1 if not pinned
+  ucs_async_context_t* async;
+  uct_component_h component;
+  uct_worker_h worker;
+  uct_md_h md;
+  uct_md_attr_t md_attr;
+  uct_iface_h iface;
+  uct_iface_attr_t iface_attr;
+  uct_ep_h ep;
+  progress_arg parg;
+  progress_engine engine;
+  rx_pool* rx;
+  size_t copy_nt_threshold;   // COPY_AUTO streams from here, see copy_tune
+
+  /* message rate and ping-pong benchmarks */
+  long am_count;
+  long am_target;
+  long pending_replies;
+  double start, end;
+  pthread_t thread;
+
+  /* atomic benchmark */
+  struct remote_buf* remote;  // counter of the peer
+  double op_lat;              // seconds per operation
+
+  /* tag benchmark */
+  long tag_unexpected;
+};
+
+/* Probe result of one transport, cached by -t auto */
+struct rank_entry {
+  tl_desc tl;
+  double lat_us;  /* p50 of 8 byte pings, negative if not supported */
+  double bw_gbs;  /* large message bandwidth, 0 if not supported */
+};
+
+struct rma_step {
+  rma_op_t op;
+  size_t size;
+  long iters;
+};
+
+struct iov_step {
+  iov_send_t method;
+  size_t frag_size;
+  int nfrags;
+  long iters;
+};
+
+struct atomic_step {
+  atomic_kind_t kind;
+  int bits;
+  long iters;
+};
+
+/*
+ * Completion of a batch of fetching atomics. `uct_comp.count` holds one
+ * reference per operation in flight plus one for the batch itself.
+ */
+struct atomic_comp {
+  uct_completion_t uct_comp;
+  bool done;
 };
 
-static void* desc_holder = NULL;
+struct remote_buf {
+  uint64_t address;
+  uct_rkey_bundle_t rkey;
+};
+
+/*
+ * One step of the message rate benchmark: `iters` messages of `size` bytes
+ * sent with `method`.
+ */
+struct rate_step {
+  func_am_t method;
+  size_t size;
+  long iters;
+};
+
+static void* desc_holder = NULL;  /* set when a single zcopy send completes */
+
+static func_am_t func_am_type = FUNC_AM_ZCOPY;
+static bench_t bench = BENCH_SINGLE;
+static progress_mode_t progress_mode = PROGRESS_MODE_POLL;
+static int num_threads = 1;
+static long rate_iters = 1000000;
+static long pingpong_iters = 100000;
+static long pingpong_warmup = 1000;
+static size_t pingpong_size = 8;
+static size_t rate_max_bytes = 1L * 1024 * 1024 * 1024;
+static unsigned rate_methods = UCS_BIT(FUNC_AM_SHORT) | UCS_BIT(FUNC_AM_BCOPY) | UCS_BIT(FUNC_AM_ZCOPY);
+static std::vector<rate_step> rate_steps;
+static bool rate_queue = false;
+static copy_variant_t pack_variant = COPY_MEMCPY;
+static copy_fn_t pack_copy = copy_memcpy;
+static int sched_num_eps = 4;
+static std::vector<atomic_step> atomic_steps;
+static uint64_t atomic_counter[8] __attribute__((aligned(64)));
+static std::vector<rank_entry> probe_results;
+static std::string rank_cache_path;
+static bool force_probe = false;
+static size_t rcache_capacity = 64 * 1024 * 1024;
+static long rcache_iters = 10000;
+static long test_strlen = 8;
+//static const char* dev_name = "mlx5_0:1";
+//static const char* tl_name = "rc_mlx5";
+static const char* dev_name = "ibs6";
+static const char* tl_name = "tcp";
+
+static const uint8_t RATE_AM_ID = 1;
+static const uint8_t PINGPONG_AM_ID = 2;
+static const uint8_t DONE_AM_ID = 3;
+static const long RMA_LAT_ITERS = 100;
+static const size_t RX_POOL_SIZE = 1024;
+static const size_t IOV_HDR_LEN = 16;
+static const int IOV_MAX_FRAGS = 64;
+static const long SCHED_BURST = 64;
+static const uint8_t RPC_NULL_AM_ID = 4;
+static const uint8_t TAG_CREDIT_AM_ID = 5;
+static const uint8_t TAG_EAGER_AM_ID = 6;
+static const uint8_t TAG_RTS_AM_ID = 7;
+static const uint8_t IOV_CHECK_AM_ID = 8;
+static const uct_tag_t TAG_VALUE = 0x1337;
+static const long TAG_DEPTH = 64;
+static const long FLUSH_MAX_OUTSTANDING = 1024;
+static const long PROBE_WARMUP = 100;
+static const long PROBE_PINGS = 1000;
+static const size_t PROBE_SIZE = 256 * 1024;
+static const size_t PROBE_BYTES = 64 * 1024 * 1024;
+static bool is_sender;
+static pthread_barrier_t start_barrier;
+static pthread_barrier_t done_barrier;
+
+static unsigned worker_progress_cb(void* arg) {
+  return uct_worker_progress(((progress_arg*)arg)->worker);
+}
+
+static ucs_status_t iface_arm_cb(void* arg) {
+  return uct_iface_event_arm(((progress_arg*)arg)->iface, UCT_EVENT_SEND_COMP | UCT_EVENT_RECV);
+}
 
 static ucs_status_t am_handler(void *arg, void *data, size_t length, unsigned flags) {
   printf("Active message handler called! (len=%ld)\n", length);
 
-  func_am_t func_am_type = *(func_am_t *)arg;
-  recv_desc_t *rdesc;
-
+  transport* tp = (transport*)arg;
   if (flags & UCT_CB_PARAM_FLAG_DESC) {
     printf("flag has UCT_CB_PARAM_FLAG_DESC.\n");
     printf("We own the buffer, which should be released later.\n");
-    rdesc = (recv_desc_t *)data - 1;
-    rdesc->is_uct_desc = 1;
-    desc_holder = rdesc;
-    return UCS_INPROGRESS;
-  }
-
-  printf("flag does not have UCT_CB_PARAM_FLAG_DESC.\n");
-  printf("We allocate a new buffer and copy out the data.\n");
-  rdesc = (recv_desc_t*)malloc(sizeof(*rdesc) + length);
-  rdesc->is_uct_desc = 0;
-  memcpy(rdesc + 1, data, length);
-  desc_holder = rdesc;
+  } else {
+    printf("flag does not have UCT_CB_PARAM_FLAG_DESC.\n");
+    printf("We copy out the data into a pool buffer.\n");
+  }
+  return rx_pool_deliver(tp->rx, data, length, flags);
+}
+
+/*
+ * Receiver side of the message rate benchmark with -Q: queue every message
+ * through the receive pool, as a real consumer would, and count it.
+ */
+static ucs_status_t am_queue_handler(void *arg, void *data, size_t length, unsigned flags) {
+  transport* tp = (transport*)arg;
+  ucs_status_t status = rx_pool_deliver(tp->rx, data, length, flags);
+  if (++tp->am_count == tp->am_target) {
+    tp->end = GetTime();
+  }
+  return status;
+}
+
+/*
+ * Receiver side of the message rate benchmark. Runs once per message, so it
+ * only counts.
+ */
+static ucs_status_t am_count_handler(void *arg, void *data, size_t length, unsigned flags) {
+  transport* tp = (transport*)arg;
+  if (++tp->am_count == tp->am_target) {
+    tp->end = GetTime();
+  }
   return UCS_OK;
 }
 
+/*
+ * Ping-pong handler. The client only counts pongs. The server echoes every
+ * ping right away; if the transport is out of resources the reply is left
+ * to the main loop.
+ */
+static ucs_status_t am_ping_handler(void *arg, void *data, size_t length, unsigned flags) {
+  transport* tp = (transport*)arg;
+  ++tp->am_count;
+  if (is_sender) return UCS_OK;
+
+  if (tp->pending_replies > 0 ||
+      uct_ep_am_short(tp->ep, PINGPONG_AM_ID, *(uint64_t*)data, (char*)data + sizeof(uint64_t),
+                      length - sizeof(uint64_t)) == UCS_ERR_NO_RESOURCE) {
+    ++tp->pending_replies;
+  }
+  return UCS_OK;
+}
+
+/*
+ * Threshold the bcopy packers of `tp` pass to copy_sized: the transport's
+ * with -P auto, none for the fixed variants.
+ */
+static size_t pack_nt_threshold(const transport* tp) {
+  return pack_variant == COPY_AUTO ? tp->copy_nt_threshold : 0;
+}
+
 size_t bcopy_packer(void *dest, void *arg) {
   bcopy_args *bc_args = (bcopy_args*)arg;
-  memcpy(dest, bc_args->data, bc_args->len);
+  copy_sized(pack_copy, bc_args->nt_threshold, dest, bc_args->data, bc_args->len);
   return bc_args->len;
 }
 
+size_t gather_packer(void *dest, void *arg) {
+  gather_args *args = (gather_args*)arg;
+  char *p = (char*)dest;
+  memcpy(p, args->header, args->header_len);
+  p += args->header_len;
+  for (int i = 0; i < args->nfrags; ++i) {
+    copy_sized(pack_copy, args->nt_threshold, p, args->base + i * args->stride, args->frag_size);
+    p += args->frag_size;
+  }
+  return p - (char*)dest;
+}
+
 void zcopy_completion_cb(uct_completion_t *self, ucs_status_t status) {
   zcopy_args *comp = (zcopy_args*)self;
   assert((comp->uct_comp.count == 0) && (status == UCS_OK));
-  if (comp->memh != UCT_MEM_HANDLE_NULL) {
-    uct_md_mem_dereg(comp->md, comp->memh);
+  if (comp->region != NULL) {
+    rcache_put(comp->cache, comp->region);
   }
   desc_holder = (void *)0xDEADBEEF;
 }
 
-int main(int argc, char** argv) {
-  /* args setup */
-  char* server_name = NULL;
-  if (argc == 1) {
-    // server
-  } else if (argc == 2) {
-    // client
-    server_name = argv[1];
-  } else {
-    printf("Usage:\n");
-    printf("  server: %s\n", argv[0]);
-    printf("  client: %s [server]\n", argv[0]);
-    return 0;
-  }
-  uint16_t server_port = 13337;
-  func_am_t func_am_type = FUNC_AM_ZCOPY;
-  long test_strlen = 8;
-  //const char* dev_name = "mlx5_0:1";
-  //const char* tl_name = "rc_mlx5";
-  const char* dev_name = "ibs6";
-  const char* tl_name = "tcp";
-  ucs_memory_type_t test_mem_type = UCS_MEMORY_TYPE_HOST; // HOST / CUDA / CUDA_MANAGED
+/*
+ * Unexpected tagged messages on an offloading iface. The tag benchmark posts
+ * receives before granting credits, so these only count.
+ */
+static ucs_status_t tag_unexp_eager_cb(void *arg, void *data, size_t length, unsigned flags, uct_tag_t stag,
+                                       uint64_t imm, void **context) {
+  transport* tp = (transport*)arg;
+  ++tp->tag_unexpected;
+  return UCS_OK;
+}
 
+static ucs_status_t tag_unexp_rndv_cb(void *arg, unsigned flags, uint64_t stag, const void *header,
+                                      unsigned header_length, uint64_t remote_addr, size_t length,
+                                      const void *rkey_buf) {
+  transport* tp = (transport*)arg;
+  ++tp->tag_unexpected;
+  return UCS_OK;
+}
+
+/*
+ * Create the async context and worker of `tp`, then enumerate uct components,
+ * memory domains, and communication resources, and open an interface with
+ * matching device name and transport name. If `tp->cpu` is set, the iface is
+ * bound to that core through params.cpu_mask.
+ * Returns false if no such transport exists.
+ */
+static bool open_transport(transport* tp, const char* tl_name, const char* dev_name, bool verbose) {
   ucs_status_t status;
 
   /*
    * ucs context creation
    * Better to use different contexts for different workers, according to hello_world
    */
-  ucs_async_context_t* async;
-  status = ucs_async_context_create(UCS_ASYNC_MODE_THREAD_SPINLOCK, &async);
+  status = ucs_async_context_create(UCS_ASYNC_MODE_THREAD_SPINLOCK, &tp->async);
   CHECK_UCS(status);
 
   /*
    * uct worker creation
    */
-  uct_worker_h worker;
-  status = uct_worker_create(async, UCS_THREAD_MODE_SINGLE, &worker);
+  status = uct_worker_create(tp->async, UCS_THREAD_MODE_SINGLE, &tp->worker);
   CHECK_UCS(status);
 
-  /*
-   * Enumerate uct components, memory domains, and communication resources.
-   * Open an interface with matching device name and transport name.
-   */
   uct_component_h* components;
   unsigned num_components;
   status = uct_query_components(&components, &num_components);
   CHECK_UCS(status);
 
-  uct_md_h md;
-  uct_md_attr_t md_attr;
-  uct_iface_h iface;
-  uct_iface_attr_t iface_attr;
   for (int i = 0; i < num_components; ++i) {
     uct_component_attr_t component_attr;
     component_attr.field_mask = UCT_COMPONENT_ATTR_FIELD_NAME
       | UCT_COMPONENT_ATTR_FIELD_MD_RESOURCE_COUNT;
     status = uct_component_query(components[i], &component_attr);
     CHECK_UCS(status);
-    printf("uct_comp[%d]: %s\n", i, component_attr.name);
+    if (verbose) printf("uct_comp[%d]: %s\n", i, component_attr.name);
 
     component_attr.field_mask = UCT_COMPONENT_ATTR_FIELD_MD_RESOURCES;
     component_attr.md_resources = (uct_md_resource_desc_t*)malloc(component_attr.md_resource_count * sizeof(uct_md_resource_desc_t));
@@ -140,24 +405,24 @@ int main(int argc, char** argv) {
       status = uct_md_config_read(components[i], NULL, NULL, &md_config);
       CHECK_UCS(status);
 
-      status = uct_md_open(components[i], component_attr.md_resources[j].md_name, md_config, &md);
+      status = uct_md_open(components[i], component_attr.md_resources[j].md_name, md_config, &tp->md);
       uct_config_release(md_config);
       CHECK_UCS(status);
 
-      status = uct_md_query(md, &md_attr);
+      status = uct_md_query(tp->md, &tp->md_attr);
       CHECK_UCS(status);
 
       uct_tl_resource_desc_t* tl_resources;
       unsigned num_tl_resources;
-      status = uct_md_query_tl_resources(md, &tl_resources, &num_tl_resources);
+      status = uct_md_query_tl_resources(tp->md, &tl_resources, &num_tl_resources);
       CHECK_UCS(status);
-      printf("  md[%d]: %s\n", j, component_attr.md_resources[j].md_name);
+      if (verbose) printf("  md[%d]: %s\n", j, component_attr.md_resources[j].md_name);
 
       for (int k = 0; k < num_tl_resources; ++k) {
-        printf("    tl[%d]: %s/%s\n", k, tl_resources[k].tl_name, tl_resources[k].dev_name);
+        if (verbose) printf("    tl[%d]: %s/%s\n", k, tl_resources[k].tl_name, tl_resources[k].dev_name);
 
         if (!strcmp(tl_resources[k].tl_name, tl_name) && !strcmp(tl_resources[k].dev_name, dev_name)) {
-          printf("    ^^^^ OPENED ^^^^\n");
+          if (verbose) printf("    ^^^^ OPENED ^^^^\n");
           uct_iface_params_t params;
           params.field_mask           = UCT_IFACE_PARAM_FIELD_OPEN_MODE
             | UCT_IFACE_PARAM_FIELD_DEVICE
@@ -170,48 +435,161 @@ int main(int argc, char** argv) {
           params.stats_root           = NULL;
           params.rx_headroom          = sizeof(recv_desc_t);
           UCS_CPU_ZERO(&params.cpu_mask);
+          if (tp->cpu >= 0) {
+            UCS_CPU_SET(tp->cpu, &params.cpu_mask);
+          }
 
           uct_iface_config_t* config;
-          status = uct_md_iface_config_read(md, tl_resources[k].tl_name, NULL, NULL, &config);
+          status = uct_md_iface_config_read(tp->md, tl_resources[k].tl_name, NULL, NULL, &config);
           CHECK_UCS(status);
 
-          status = uct_iface_open(md, worker, &params, config, &iface);
+          if (bench == BENCH_TAG) {
+            /*
+             * Ask for tag offload; transports without it do not know the
+             * option, which is fine.
+             */
+            uct_config_modify(config, "TM_ENABLE", "y");
+            params.field_mask |= UCT_IFACE_PARAM_FIELD_HW_TM_EAGER_ARG
+              | UCT_IFACE_PARAM_FIELD_HW_TM_EAGER_CB
+              | UCT_IFACE_PARAM_FIELD_HW_TM_RNDV_ARG
+              | UCT_IFACE_PARAM_FIELD_HW_TM_RNDV_CB;
+            params.eager_arg = tp;
+            params.eager_cb  = tag_unexp_eager_cb;
+            params.rndv_arg  = tp;
+            params.rndv_cb   = tag_unexp_rndv_cb;
+          }
+
+          status = uct_iface_open(tp->md, tp->worker, &params, config, &tp->iface);
           uct_config_release(config);
           CHECK_UCS(status);
 
-          uct_iface_progress_enable(iface, UCT_PROGRESS_SEND | UCT_PROGRESS_RECV);
+          uct_iface_progress_enable(tp->iface, UCT_PROGRESS_SEND | UCT_PROGRESS_RECV);
 
-          status = uct_iface_query(iface, &iface_attr);
+          status = uct_iface_query(tp->iface, &tp->iface_attr);
           CHECK_UCS(status);
+          tp->copy_nt_threshold = tp->iface_attr.cap.flags & UCT_IFACE_FLAG_AM_BCOPY ?
+                                  copy_tune(tp->iface_attr.cap.am.max_bcopy) : COPY_NT_THRESHOLD;
+          /*
+           * Size the slab for the largest AM the peer can send, zcopy included,
+           * so the receive handler never falls back to malloc on a full-size
+           * message
+           */
+          size_t max_payload = std::max(tp->iface_attr.cap.am.max_short, tp->iface_attr.cap.am.max_bcopy);
+          if (tp->iface_attr.cap.flags & UCT_IFACE_FLAG_AM_ZCOPY) {
+            max_payload = std::max(max_payload, tp->iface_attr.cap.am.max_zcopy);
+          }
+          tp->rx = rx_pool_create(RX_POOL_SIZE, params.rx_headroom, max_payload);
 
           uct_release_tl_resource_list(tl_resources);
           free(component_attr.md_resources);
+          tp->component = components[i];
+          tp->tag_unexpected = 0;
           uct_release_component_list(components);
-
-          goto iface_opened;
+          tp->ep = NULL;
+          return true;
         }
       }
       uct_release_tl_resource_list(tl_resources);
+      uct_md_close(tp->md);
+    }
+    free(component_attr.md_resources);
+  }
+  uct_release_component_list(components);
+  uct_worker_destroy(tp->worker);
+  ucs_async_context_destroy(tp->async);
+  return false;
+}
+
+/*
+ * List every communication resource of every memory domain.
+ */
+static std::vector<tl_desc> list_transports() {
+  std::vector<tl_desc> tls;
+  ucs_status_t status;
+
+  uct_component_h* components;
+  unsigned num_components;
+  status = uct_query_components(&components, &num_components);
+  CHECK_UCS(status);
+
+  for (int i = 0; i < num_components; ++i) {
+    uct_component_attr_t component_attr;
+    component_attr.field_mask = UCT_COMPONENT_ATTR_FIELD_MD_RESOURCE_COUNT;
+    status = uct_component_query(components[i], &component_attr);
+    CHECK_UCS(status);
+
+    component_attr.field_mask = UCT_COMPONENT_ATTR_FIELD_MD_RESOURCES;
+    component_attr.md_resources = (uct_md_resource_desc_t*)malloc(component_attr.md_resource_count * sizeof(uct_md_resource_desc_t));
+    status = uct_component_query(components[i], &component_attr);
+    CHECK_UCS(status);
+
+    for (int j = 0; j < component_attr.md_resource_count; ++j) {
+      uct_md_config_t* md_config;
+      status = uct_md_config_read(components[i], NULL, NULL, &md_config);
+      CHECK_UCS(status);
+
+      uct_md_h md;
+      status = uct_md_open(components[i], component_attr.md_resources[j].md_name, md_config, &md);
+      uct_config_release(md_config);
+      CHECK_UCS(status);
+
+      uct_tl_resource_desc_t* tl_resources;
+      unsigned num_tl_resources;
+      status = uct_md_query_tl_resources(md, &tl_resources, &num_tl_resources);
+      CHECK_UCS(status);
+
+      for (int k = 0; k < num_tl_resources; ++k) {
+        tls.push_back(tl_desc{tl_resources[k].tl_name, tl_resources[k].dev_name});
+      }
+      uct_release_tl_resource_list(tl_resources);
       uct_md_close(md);
     }
     free(component_attr.md_resources);
   }
   uct_release_component_list(components);
+  return tls;
+}
 
-  printf("Transport not found.\n");
-  exit(EXIT_FAILURE);
+/*
+ * Transports present on both sides, in the client's enumeration order.
+ */
+static std::vector<tl_desc> common_transports(int oob_sock) {
+  std::vector<tl_desc> own = list_transports();
 
-iface_opened:
+  std::string own_list;
+  for (const tl_desc& tl : own) {
+    own_list += tl.tl_name + "/" + tl.dev_name + "\n";
+  }
 
-  /*
-   * Open out-of-band connection
-   */
-  int oob_sock;
-  if (server_name) {
-    oob_sock = client_connect(server_name, server_port);
-  } else {
-    oob_sock = server_connect(server_port);
+  char* peer_buf;
+  sendrecv(oob_sock, own_list.c_str(), own_list.size() + 1, (void **)&peer_buf);
+  std::string peer_list(peer_buf);
+  free(peer_buf);
+
+  const std::string& client_list = is_sender ? own_list : peer_list;
+  const std::string& server_list = is_sender ? peer_list : own_list;
+
+  std::vector<tl_desc> common;
+  size_t pos = 0, end;
+  while ((end = client_list.find('\n', pos)) != std::string::npos) {
+    std::string line = client_list.substr(pos, end - pos + 1);
+    pos = end + 1;
+    if (server_list.find(line) != 0 && server_list.find("\n" + line) == std::string::npos) continue;
+
+    size_t slash = line.find('/');
+    common.push_back(tl_desc{line.substr(0, slash), line.substr(slash + 1, line.size() - slash - 2)});
   }
+  return common;
+}
+
+/*
+ * Exchange addresses with the peer over the out-of-band socket and create an
+ * endpoint on the iface of `tp` in `*ep`. Returns false, with both sides
+ * agreeing, if either side cannot reach the other through this transport.
+ */
+static bool connect_ep(transport* tp, int oob_sock, bool verbose, uct_ep_h* ep) {
+  ucs_status_t status;
+  uct_iface_attr_t& iface_attr = tp->iface_attr;
 
   /*
    * Exchange device address.
@@ -219,12 +597,14 @@ iface_opened:
   uct_device_addr_t* own_dev;
   own_dev = (uct_device_addr_t*)calloc(1, iface_attr.device_addr_len);
 
-  status = uct_iface_get_device_address(iface, own_dev);
+  status = uct_iface_get_device_address(tp->iface, own_dev);
   CHECK_UCS(status);
 
-  printf("own_dev =");
-  for (int i = 0; i < iface_attr.device_addr_len; ++i) printf(" %02X", ((unsigned char*)own_dev)[i]);
-  printf("\n");
+  if (verbose) {
+    printf("own_dev =");
+    for (int i = 0; i < iface_attr.device_addr_len; ++i) printf(" %02X", ((unsigned char*)own_dev)[i]);
+    printf("\n");
+  }
 
   uct_device_addr_t* peer_dev;
   sendrecv(oob_sock, own_dev, iface_attr.device_addr_len, (void **)&peer_dev);
@@ -232,25 +612,36 @@ iface_opened:
   /*
    * Exchange interface address.
    */
-  uct_iface_is_reachable(iface, peer_dev, NULL);
-
-  uct_iface_addr_t* peer_iface;
+  uct_iface_addr_t* peer_iface = NULL;
   if (iface_attr.cap.flags & UCT_IFACE_FLAG_CONNECT_TO_IFACE) {
-    printf("Exchanging interface address...\n");
+    if (verbose) printf("Exchanging interface address...\n");
 
     uct_iface_addr_t* own_iface;
     own_iface = (uct_iface_addr_t*)calloc(1, iface_attr.iface_addr_len);
 
-    status = uct_iface_get_address(iface, own_iface);
+    status = uct_iface_get_address(tp->iface, own_iface);
     CHECK_UCS(status);
 
-    printf("own_iface =");
-    for (int i = 0; i < iface_attr.iface_addr_len; ++i) printf(" %02X", ((unsigned char*)own_iface)[i]);
-    printf("\n");
+    if (verbose) {
+      printf("own_iface =");
+      for (int i = 0; i < iface_attr.iface_addr_len; ++i) printf(" %02X", ((unsigned char*)own_iface)[i]);
+      printf("\n");
+    }
 
     sendrecv(oob_sock, own_iface, iface_attr.iface_addr_len, (void **)&peer_iface);
+    free(own_iface);
   } else {
-    printf("Skipping interface address exchange...\n");
+    if (verbose) printf("Skipping interface address exchange...\n");
+  }
+
+  /*
+   * Both sides must agree before creating endpoints.
+   */
+  if (!agree(oob_sock, uct_iface_is_reachable(tp->iface, peer_dev, peer_iface))) {
+    free(own_dev);
+    free(peer_dev);
+    free(peer_iface);
+    return false;
   }
 
   /*
@@ -258,52 +649,109 @@ iface_opened:
    */
   uct_ep_params_t     ep_params;
   ep_params.field_mask = UCT_EP_PARAM_FIELD_IFACE;
-  ep_params.iface      = iface;
-  uct_ep_h ep;
+  ep_params.iface      = tp->iface;
   if (iface_attr.cap.flags & UCT_IFACE_FLAG_CONNECT_TO_EP) {
-    printf("Exchanging endpoint address...\n");
+    if (verbose) printf("Exchanging endpoint address...\n");
 
     uct_ep_addr_t* own_ep;
     own_ep = (uct_ep_addr_t*)calloc(1, iface_attr.ep_addr_len);
 
-    status = uct_ep_create(&ep_params, &ep);
+    status = uct_ep_create(&ep_params, ep);
     CHECK_UCS(status);
 
-    status = uct_ep_get_address(ep, own_ep);
+    status = uct_ep_get_address(*ep, own_ep);
     CHECK_UCS(status);
 
-    printf("own_ep =");
-    for (int i = 0; i < iface_attr.ep_addr_len; ++i) printf(" %02X", ((unsigned char*)own_ep)[i]);
-    printf("\n");
+    if (verbose) {
+      printf("own_ep =");
+      for (int i = 0; i < iface_attr.ep_addr_len; ++i) printf(" %02X", ((unsigned char*)own_ep)[i]);
+      printf("\n");
+    }
 
     uct_ep_addr_t* peer_ep;
     sendrecv(oob_sock, own_ep, iface_attr.ep_addr_len, (void **)&peer_ep);
 
-    status = uct_ep_connect_to_ep(ep, peer_dev, peer_ep);
+    status = uct_ep_connect_to_ep(*ep, peer_dev, peer_ep);
 
     barrier(oob_sock);
+    free(own_ep);
+    free(peer_ep);
   } else {
     assert(iface_attr.cap.flags & UCT_IFACE_FLAG_CONNECT_TO_IFACE);
 
-    printf("Creating endpoint...\n");
+    if (verbose) printf("Creating endpoint...\n");
 
     ep_params.field_mask |= UCT_EP_PARAM_FIELD_DEV_ADDR
       | UCT_EP_PARAM_FIELD_IFACE_ADDR;
     ep_params.dev_addr    = peer_dev;
     ep_params.iface_addr  = peer_iface;
-    status = uct_ep_create(&ep_params, &ep);
+    status = uct_ep_create(&ep_params, ep);
     CHECK_UCS(status);
   }
 
-  printf("max_short = %ld\n", iface_attr.cap.am.max_short);
-  printf("max_bcopy = %ld\n", iface_attr.cap.am.max_bcopy);
-  printf("max_zcopy = %ld\n", iface_attr.cap.am.max_zcopy);
+  free(own_dev);
+  free(peer_dev);
+  free(peer_iface);
+  return true;
+}
+
+/*
+ * Connect the endpoint of `tp`, see connect_ep().
+ */
+static bool connect_transport(transport* tp, int oob_sock, bool verbose) {
+  return connect_ep(tp, oob_sock, verbose, &tp->ep);
+}
+
+/*
+ * Set up the progress engine of `tp`. Sleeping needs an event fd, so
+ * transports without one can only be polled.
+ */
+static void init_progress(transport* tp) {
+  progress_mode_t mode = progress_mode;
+  int event_fd = -1;
+  if (mode != PROGRESS_MODE_POLL) {
+    if (tp->iface_attr.cap.event_flags & UCT_IFACE_FLAG_EVENT_FD) {
+      ucs_status_t status = uct_iface_event_fd_get(tp->iface, &event_fd);
+      CHECK_UCS(status);
+    } else {
+      printf("Transport has no event fd. Falling back to polling.\n");
+      mode = PROGRESS_MODE_POLL;
+    }
+  }
+  tp->parg.worker = tp->worker;
+  tp->parg.iface = tp->iface;
+  progress_engine_init(&tp->engine, mode, &tp->parg, worker_progress_cb, iface_arm_cb, NULL, event_fd);
+}
+
+static void close_transport(transport* tp) {
+  rx_pool_print(tp->rx);
+  rx_pool_destroy(tp->rx);
+  if (tp->ep != NULL) {
+    progress_engine_print(&tp->engine);
+    progress_engine_cleanup(&tp->engine);
+    uct_ep_destroy(tp->ep);
+  }
+  uct_iface_close(tp->iface);
+  uct_md_close(tp->md);
+  uct_worker_destroy(tp->worker);
+  ucs_async_context_destroy(tp->async);
+}
 
+/*
+ * Send (or receive) a single active message with the method selected by
+ * func_am_type.
+ */
+static void run_single(transport* tp, bool is_sender) {
+  ucs_status_t status;
+  uct_ep_h ep = tp->ep;
+  uct_worker_h worker = tp->worker;
+  uct_md_h md = tp->md;
   uint8_t id = 0;
-  status = uct_iface_set_am_handler(iface, id, am_handler, &func_am_type, 0);
+
+  status = uct_iface_set_am_handler(tp->iface, id, am_handler, tp, 0);
   CHECK_UCS(status);
 
-  if (server_name) {
+  if (is_sender) {
     size_t bufsz = test_strlen;
     char* buf = (char*)malloc(bufsz);
 
@@ -312,7 +760,7 @@ iface_opened:
       uint64_t header = *(uint64_t*)buf;
       char* payload;
       size_t len;
-      if (len > sizeof(header)) {
+      if (bufsz > sizeof(header)) {
         payload = buf + sizeof(header);
         len = bufsz - sizeof(header);
       } else {
@@ -334,6 +782,7 @@ iface_opened:
       bcopy_args args;
       args.data = buf;
       args.len = bufsz;
+      args.nt_threshold = pack_nt_threshold(tp);
       do {
         /*
          * For bcopy, we need packer callback + argument pointer.
@@ -346,14 +795,16 @@ iface_opened:
     } else if (func_am_type == FUNC_AM_ZCOPY) {
       printf("Send with zcopy...\n");
 
-      uct_mem_h memh;
-      if (md_attr.cap.flags & UCT_MD_FLAG_NEED_MEMH) {
+      rcache cache;
+      rcache_init(&cache, md, UCT_MD_MEM_ACCESS_RMA, rcache_capacity);
+      rcache_region* region = NULL;
+      uct_mem_h memh = UCT_MEM_HANDLE_NULL;
+      if (tp->md_attr.cap.flags & UCT_MD_FLAG_NEED_MEMH) {
         printf("Need memory handle. Registering memory...\n");
-        status = uct_md_mem_reg(md, buf, bufsz, UCT_MD_MEM_ACCESS_RMA, &memh);
-        CHECK_UCS(status);
+        region = rcache_get(&cache, buf, bufsz);
+        memh = region->memh;
       } else {
         printf("Do not need memory handle.\n");
-        memh = UCT_MEM_HANDLE_NULL;
       }
 
       uct_iov_t iov;
@@ -366,8 +817,8 @@ iface_opened:
       zcopy_args comp;
       comp.uct_comp.func  = zcopy_completion_cb;
       comp.uct_comp.count = 1;
-      comp.md             = md;
-      comp.memh           = memh;
+      comp.cache          = &cache;
+      comp.region         = region;
 
       do {
         /*
@@ -380,39 +831,2083 @@ iface_opened:
 
       if (status == UCS_INPROGRESS) {
         printf("UCS_INPROGRESS returned. Forcing worker to progress...\n");
-        while (!desc_holder) {
-          uct_worker_progress(worker);
-        }
+        progress_until(&tp->engine, [] { return desc_holder != NULL; });
         status = UCS_OK;
+      } else if (region != NULL) {
+        rcache_put(&cache, region);
       }
       CHECK_UCS(status);
+      rcache_cleanup(&cache);
     } else {
       assert(false && "Unsupported type");
     }
     free(buf);
   } else {
-    recv_desc_t *rdesc;
+    recv_desc_t *rdesc = NULL;
+
+    progress_until(&tp->engine, [&] { return (rdesc = rx_pool_pop(tp->rx)) != NULL; });
+
+    printf("Received %u bytes\n", rdesc->length);
+    rx_pool_release(tp->rx, rdesc);
+    rx_pool_flush(tp->rx);
+  }
+}
+
+/*
+ * Wait until everything posted on `ep`, an endpoint on the iface of `tp`, has
+ * completed.
+ */
+static void ep_flush(transport* tp, uct_ep_h ep) {
+  ucs_status_t status;
+  while ((status = uct_ep_flush(ep, 0, NULL)) != UCS_OK) {
+    CHECK_COND(status == UCS_INPROGRESS || status == UCS_ERR_NO_RESOURCE);
+    uct_worker_progress(tp->worker);
+  }
+}
+
+static void ep_flush(transport* tp) {
+  ep_flush(tp, tp->ep);
+}
+
+/*
+ * Post step.iters messages as fast as the transport accepts them. The first 8
+ * bytes of a short message travel in the AM header. Zcopy sends are posted
+ * without a completion; the final flush covers them, and the buffer is never
+ * modified.
+ */
+static void rate_send(transport* tp, const rate_step& step, char* buf, uct_mem_h memh) {
+  ucs_status_t status;
 
-    while (desc_holder == NULL) {
-      uct_worker_progress(worker);
+  if (step.method == FUNC_AM_SHORT) {
+    uint64_t header = *(uint64_t*)buf;
+    for (long i = 0; i < step.iters; ++i) {
+      while ((status = uct_ep_am_short(tp->ep, RATE_AM_ID, header, buf + sizeof(header),
+                                       step.size - sizeof(header))) == UCS_ERR_NO_RESOURCE) {
+        uct_worker_progress(tp->worker);
+      }
+      CHECK_UCS(status);
+    }
+  } else if (step.method == FUNC_AM_BCOPY) {
+    bcopy_args args;
+    args.data = buf;
+    args.len = step.size;
+    args.nt_threshold = pack_nt_threshold(tp);
+    for (long i = 0; i < step.iters; ++i) {
+      ssize_t len;
+      while ((len = uct_ep_am_bcopy(tp->ep, RATE_AM_ID, bcopy_packer, &args, 0)) == UCS_ERR_NO_RESOURCE) {
+        uct_worker_progress(tp->worker);
+      }
+      CHECK_UCS(len >= 0 ? UCS_OK : (ucs_status_t)len);
+    }
+  } else {
+    uct_iov_t iov;
+    iov.buffer          = buf;
+    iov.length          = step.size;
+    iov.memh            = memh;
+    iov.stride          = 0;
+    iov.count           = 1;
+    for (long i = 0; i < step.iters; ++i) {
+      while ((status = uct_ep_am_zcopy(tp->ep, RATE_AM_ID, NULL, 0, &iov, 1, 0, NULL)) == UCS_ERR_NO_RESOURCE) {
+        uct_worker_progress(tp->worker);
+      }
+      CHECK_COND(status == UCS_OK || status == UCS_INPROGRESS);
     }
+  }
+  ep_flush(tp);
+}
+
+/*
+ * Pin the calling thread to the core of `tp`, if it has one.
+ */
+static void bind_thread(const transport* tp) {
+  if (tp->cpu >= 0) {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(tp->cpu, &cpu_set);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+  }
+}
+
+/*
+ * One thread of the message rate benchmark. For every step the sender blasts
+ * the step's messages, and the receiver counts them in am_count_handler.
+ * Threads of both sides start each step together (see run_rate).
+ */
+static void* rate_thread(void* arg) {
+  transport* tp = (transport*)arg;
+  ucs_status_t status;
+
+  bind_thread(tp);
+
+  size_t bufsz = 0;
+  for (const rate_step& step : rate_steps) {
+    bufsz = std::max(bufsz, step.size);
+  }
+  char* buf = (char*)calloc(1, bufsz);
+
+  uct_mem_h memh = UCT_MEM_HANDLE_NULL;
+  if (is_sender && (rate_methods & UCS_BIT(FUNC_AM_ZCOPY)) && (tp->md_attr.cap.flags & UCT_MD_FLAG_NEED_MEMH)) {
+    status = uct_md_mem_reg(tp->md, buf, bufsz, UCT_MD_MEM_ACCESS_RMA, &memh);
+    CHECK_UCS(status);
+  }
 
-    rdesc = (recv_desc_t*)desc_holder;
+  for (const rate_step& step : rate_steps) {
+    tp->am_count = 0;
+    tp->am_target = step.iters;
+    pthread_barrier_wait(&start_barrier);
 
-    if (rdesc->is_uct_desc) {
-      uct_iface_release_desc(rdesc);
+    tp->start = GetTime();
+    if (is_sender) {
+      rate_send(tp, step, buf, memh);
+      tp->end = GetTime();
     } else {
-      free(rdesc);
+      progress_until(&tp->engine, [tp] {
+        for (recv_desc_t* desc; (desc = rx_pool_pop(tp->rx)) != NULL; ) {
+          rx_pool_release(tp->rx, desc);
+        }
+        return tp->am_count >= tp->am_target;
+      });
+      rx_pool_flush(tp->rx);
+    }
+    pthread_barrier_wait(&done_barrier);
+  }
+
+  if (memh != UCT_MEM_HANDLE_NULL) {
+    uct_md_mem_dereg(tp->md, memh);
+  }
+  free(buf);
+  return NULL;
+}
+
+/*
+ * Build the list of (method, size) steps: powers of two from 8 bytes up to
+ * the method's limit, plus the limit itself. Limits are agreed with the peer
+ * so both sides walk the same steps. Each step sends rate_iters messages, but
+ * no more than rate_max_bytes.
+ */
+static void build_rate_steps(const uct_iface_attr_t& iface_attr, int oob_sock) {
+  uint64_t cap_flags[] = {UCT_IFACE_FLAG_AM_SHORT, UCT_IFACE_FLAG_AM_BCOPY, UCT_IFACE_FLAG_AM_ZCOPY};
+  /*
+   * Limits of short, bcopy and zcopy, then min_zcopy
+   */
+  size_t own_caps[] = {iface_attr.cap.am.max_short, iface_attr.cap.am.max_bcopy, iface_attr.cap.am.max_zcopy,
+                       iface_attr.cap.am.min_zcopy};
+  for (int method = FUNC_AM_SHORT; method <= FUNC_AM_ZCOPY; ++method) {
+    if (!(iface_attr.cap.flags & cap_flags[method])) own_caps[method] = 0;
+  }
+  size_t* peer_caps;
+  sendrecv(oob_sock, own_caps, sizeof(own_caps), (void **)&peer_caps);
+
+  rate_steps.clear();
+  for (int method = FUNC_AM_SHORT; method <= FUNC_AM_ZCOPY; ++method) {
+    size_t max_size = std::min(own_caps[method], peer_caps[method]);
+    size_t min_zcopy = std::max(own_caps[FUNC_AM_ZCOPY + 1], peer_caps[FUNC_AM_ZCOPY + 1]);
+    size_t min_size = std::max(sizeof(uint64_t), method == FUNC_AM_ZCOPY ? min_zcopy : 0);
+    if (!(rate_methods & UCS_BIT(method))) continue;
+    if (max_size < min_size) {
+      printf("Transport does not support %s active messages. Skipping.\n", func_am_names[method]);
+      continue;
+    }
+
+    for (size_t size = min_size; ; size = std::min(size * 2, max_size)) {
+      rate_step step;
+      step.method = (func_am_t)method;
+      step.size = size;
+      step.iters = std::min(rate_iters, std::max(1L, (long)(rate_max_bytes / size)));
+      rate_steps.push_back(step);
+      if (size == max_size) break;
+    }
+  }
+  free(peer_caps);
+}
+
+/*
+ * Run the message rate benchmark on every transport concurrently, one thread
+ * each, and report the aggregate rate for every step.
+ */
+static void run_rate(std::vector<transport>& tps, int oob_sock) {
+  ucs_status_t status;
+
+  build_rate_steps(tps[0].iface_attr, oob_sock);
+
+  for (transport& tp : tps) {
+    status = uct_iface_set_am_handler(tp.iface, RATE_AM_ID, rate_queue ? am_queue_handler : am_count_handler, &tp, 0);
+    CHECK_UCS(status);
+  }
+
+  pthread_barrier_init(&start_barrier, NULL, tps.size() + 1);
+  pthread_barrier_init(&done_barrier, NULL, tps.size() + 1);
+  for (transport& tp : tps) {
+    pthread_create(&tp.thread, NULL, rate_thread, &tp);
+  }
+
+  printf("%s active messages on %ld threads\n", is_sender ? "Sending" : "Receiving", tps.size());
+  printf("%6s %10s %10s %10s %10s %10s\n", "method", "size", "iters", "sec", "Mmsg/s", "GB/s");
+  for (const rate_step& step : rate_steps) {
+    /*
+     * Release the threads on both sides at about the same time
+     */
+    barrier(oob_sock);
+    pthread_barrier_wait(&start_barrier);
+    pthread_barrier_wait(&done_barrier);
+
+    double start = tps[0].start, end = tps[0].end;
+    for (transport& tp : tps) {
+      start = std::min(start, tp.start);
+      end = std::max(end, tp.end);
     }
+    long msgs = step.iters * tps.size();
+    printf("%6s %10lu %10ld %10.4f %10.3f %10.3f\n", func_am_names[step.method], step.size, step.iters,
+        end - start, msgs / 1e6 / (end - start), msgs * step.size / 1e9 / (end - start));
+  }
+
+  for (transport& tp : tps) {
+    pthread_join(tp.thread, NULL);
+  }
+  pthread_barrier_destroy(&start_barrier);
+  pthread_barrier_destroy(&done_barrier);
+}
+
+static void print_pingpong_header() {
+  printf("Ping-pong latency, half round trip in us\n");
+  printf("%-24s %8s %10s %9s %9s %9s %9s %9s %9s\n",
+      "transport", "size", "iters", "min", "p50", "p90", "p99", "p99.9", "max");
+}
+
+/*
+ * Ping-pong latency: the client sends a short AM and waits for the echo. Half
+ * of every round trip is taken with ucs_get_time (the CPU cycle counter where
+ * available) and recorded into `hist` on the client.
+ * Returns false if either side cannot send `size` bytes as a short AM.
+ */
+static bool pingpong(transport* tp, size_t size, long warmup, long iters, latency_histogram* hist, int oob_sock) {
+  ucs_status_t status;
+
+  if (!agree(oob_sock, (tp->iface_attr.cap.flags & UCT_IFACE_FLAG_AM_SHORT) &&
+                       tp->iface_attr.cap.am.max_short >= size)) {
+    return false;
   }
 
+  tp->am_count = 0;
+  tp->pending_replies = 0;
+  status = uct_iface_set_am_handler(tp->iface, PINGPONG_AM_ID, am_ping_handler, tp, 0);
+  CHECK_UCS(status);
   barrier(oob_sock);
 
-  uct_ep_destroy(ep);
-  uct_iface_close(iface);
-  uct_md_close(md);
-  uct_worker_destroy(worker);
-  ucs_async_context_destroy(async);
+  char* buf = (char*)calloc(1, size);
+  uint64_t header = 0;
+  long total = warmup + iters;
+
+  hist_init(hist);
+  if (is_sender) {
+    for (long i = 0; i < total; ++i) {
+      long expect = tp->am_count + 1;
+      ucs_time_t st = ucs_get_time();
+      while ((status = uct_ep_am_short(tp->ep, PINGPONG_AM_ID, header, buf + sizeof(header),
+                                       size - sizeof(header))) == UCS_ERR_NO_RESOURCE) {
+        uct_worker_progress(tp->worker);
+      }
+      CHECK_UCS(status);
+      progress_until(&tp->engine, [tp, expect] { return tp->am_count >= expect; });
+      ucs_time_t et = ucs_get_time();
+
+      if (i >= warmup) {
+        hist_record(hist, (uint64_t)ucs_time_to_nsec(et - st) / 2);
+      }
+    }
+  } else {
+    progress_until(&tp->engine, [&] {
+      while (tp->pending_replies > 0) {
+        status = uct_ep_am_short(tp->ep, PINGPONG_AM_ID, header, buf + sizeof(header), size - sizeof(header));
+        if (status == UCS_ERR_NO_RESOURCE) break;
+        CHECK_UCS(status);
+        --tp->pending_replies;
+      }
+      return tp->am_count >= total && tp->pending_replies == 0;
+    });
+  }
+  free(buf);
+  return true;
+}
+
+static void run_pingpong(transport* tp, const char* label, int oob_sock) {
+  latency_histogram hist;
+  if (!pingpong(tp, pingpong_size, pingpong_warmup, pingpong_iters, &hist, oob_sock)) {
+    printf("%-24s does not support %lu byte short active messages\n", label, pingpong_size);
+  } else if (is_sender) {
+    printf("%-24s %8lu %10ld %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n", label, pingpong_size, pingpong_iters,
+        hist.min / 1e3, hist_percentile(&hist, 50) / 1e3, hist_percentile(&hist, 90) / 1e3,
+        hist_percentile(&hist, 99) / 1e3, hist_percentile(&hist, 99.9) / 1e3, hist.max / 1e3);
+  } else {
+    printf("%-24s echoed %ld pings\n", label, tp->am_count);
+  }
+}
+
+/*
+ * Build the RMA steps like build_rate_steps: powers of two from 8 bytes up to
+ * the smaller of both sides' limits for every operation.
+ */
+static std::vector<rma_step> build_rma_steps(const uct_iface_attr_t& iface_attr, int oob_sock) {
+  const uct_iface_attr_t& a = iface_attr;
+  uint64_t cap_flags[] = {UCT_IFACE_FLAG_PUT_SHORT, UCT_IFACE_FLAG_PUT_BCOPY, UCT_IFACE_FLAG_PUT_ZCOPY,
+                          UCT_IFACE_FLAG_GET_ZCOPY, UCT_IFACE_FLAG_AM_ZCOPY};
+  size_t own_max[] = {a.cap.put.max_short, a.cap.put.max_bcopy, a.cap.put.max_zcopy,
+                      a.cap.get.max_zcopy, a.cap.am.max_zcopy};
+  size_t min_zcopy[] = {0, 0, a.cap.put.min_zcopy, a.cap.get.min_zcopy, a.cap.am.min_zcopy};
+  for (int op = RMA_PUT_SHORT; op <= RMA_AM_ZCOPY; ++op) {
+    if (!(a.cap.flags & cap_flags[op])) own_max[op] = 0;
+  }
+  size_t* peer_max;
+  sendrecv(oob_sock, own_max, sizeof(own_max), (void **)&peer_max);
+
+  std::vector<rma_step> steps;
+  for (int op = RMA_PUT_SHORT; op <= RMA_AM_ZCOPY; ++op) {
+    size_t max_size = std::min(own_max[op], peer_max[op]);
+    size_t min_size = std::max(sizeof(uint64_t), min_zcopy[op]);
+    if (max_size < min_size) {
+      printf("Transport does not support %s. Skipping.\n", rma_op_names[op]);
+      continue;
+    }
+
+    for (size_t size = min_size; ; size = std::min(size * 2, max_size)) {
+      rma_step step;
+      step.op = (rma_op_t)op;
+      step.size = size;
+      step.iters = std::min(rate_iters, std::max(1L, (long)(rate_max_bytes / size)));
+      steps.push_back(step);
+      if (size == max_size) break;
+    }
+  }
+  free(peer_max);
+  return steps;
+}
+
+/*
+ * Post one operation of `step`, retrying while the transport is out of
+ * resources. Zcopy operations complete on the next flush.
+ */
+static void rma_post(transport* tp, const rma_step& step, char* buf, uct_mem_h memh, const remote_buf& remote) {
+  ucs_status_t status;
+  uct_iov_t iov;
+  iov.buffer = buf;
+  iov.length = step.size;
+  iov.memh   = memh;
+  iov.stride = 0;
+  iov.count  = 1;
+
+  for (;;) {
+    if (step.op == RMA_PUT_SHORT) {
+      status = uct_ep_put_short(tp->ep, buf, step.size, remote.address, remote.rkey.rkey);
+    } else if (step.op == RMA_PUT_BCOPY) {
+      bcopy_args args;
+      args.data = buf;
+      args.len = step.size;
+      args.nt_threshold = pack_nt_threshold(tp);
+      ssize_t len = uct_ep_put_bcopy(tp->ep, bcopy_packer, &args, remote.address, remote.rkey.rkey);
+      status = len >= 0 ? UCS_OK : (ucs_status_t)len;
+    } else if (step.op == RMA_PUT_ZCOPY) {
+      status = uct_ep_put_zcopy(tp->ep, &iov, 1, remote.address, remote.rkey.rkey, NULL);
+    } else if (step.op == RMA_GET_ZCOPY) {
+      status = uct_ep_get_zcopy(tp->ep, &iov, 1, remote.address, remote.rkey.rkey, NULL);
+    } else {
+      status = uct_ep_am_zcopy(tp->ep, RATE_AM_ID, NULL, 0, &iov, 1, 0, NULL);
+    }
+    if (status != UCS_ERR_NO_RESOURCE) break;
+    uct_worker_progress(tp->worker);
+  }
+  CHECK_COND(status == UCS_OK || status == UCS_INPROGRESS);
+}
+
+/*
+ * Register `buf` for remote access, pack its rkey and swap it with the peer
+ * for the peer's. The rkey is not needed if the md cannot register memory.
+ */
+static void exchange_rkey(transport* tp, void* buf, size_t len, unsigned access, uct_mem_h* memh, remote_buf* remote,
+                          int oob_sock) {
+  ucs_status_t status;
+  bool can_reg = tp->md_attr.cap.flags & UCT_MD_FLAG_REG;
+  size_t rkey_len = can_reg ? tp->md_attr.rkey_packed_size : 0;
+
+  *memh = UCT_MEM_HANDLE_NULL;
+  char* own = (char*)calloc(1, sizeof(uint64_t) + rkey_len);
+  *(uint64_t*)own = (uintptr_t)buf;
+  if (can_reg) {
+    status = uct_md_mem_reg(tp->md, buf, len, access, memh);
+    CHECK_UCS(status);
+    status = uct_md_mkey_pack(tp->md, *memh, own + sizeof(uint64_t));
+    CHECK_UCS(status);
+  }
+
+  char* peer;
+  sendrecv(oob_sock, own, sizeof(uint64_t) + rkey_len, (void **)&peer);
+  remote->address = *(uint64_t*)peer;
+  if (can_reg) {
+    status = uct_rkey_unpack(tp->component, peer + sizeof(uint64_t), &remote->rkey);
+    CHECK_UCS(status);
+  } else {
+    remote->rkey.rkey = UCT_INVALID_RKEY;
+  }
+  free(peer);
+  free(own);
+}
+
+/*
+ * One-sided put/get benchmark. The server only exposes its buffer and keeps
+ * progressing (some transports, e.g. tcp, need the target to progress RMA).
+ * For every step the client measures the rate of `iters` operations followed
+ * by one flush, and the latency of single operations each followed by a
+ * flush. AM zcopy runs the same way as a two-sided baseline. The client ends
+ * each step with a short AM, which the server waits for.
+ */
+static void run_rma(transport* tp, int oob_sock) {
+  ucs_status_t status;
+
+  std::vector<rma_step> steps = build_rma_steps(tp->iface_attr, oob_sock);
+  size_t bufsz = sizeof(uint64_t);
+  for (const rma_step& step : steps) {
+    bufsz = std::max(bufsz, step.size);
+  }
+  char* buf = (char*)calloc(1, bufsz);
+  uct_mem_h memh;
+  remote_buf remote;
+  exchange_rkey(tp, buf, bufsz, UCT_MD_MEM_ACCESS_RMA, &memh, &remote, oob_sock);
+
+  tp->am_count = 0;
+  tp->am_target = -1;
+  status = uct_iface_set_am_handler(tp->iface, RATE_AM_ID, am_count_handler, tp, 0);
+  CHECK_UCS(status);
+  status = uct_iface_set_am_handler(tp->iface, DONE_AM_ID, am_count_handler, tp, 0);
+  CHECK_UCS(status);
+
+  if (is_sender) {
+    printf("%10s %10s %10s %10s %10s %10s\n", "op", "size", "iters", "Mops/s", "GB/s", "lat (us)");
+  } else {
+    printf("Serving %lu bytes for remote access\n", bufsz);
+  }
+
+  long expect = 0;
+  for (const rma_step& step : steps) {
+    barrier(oob_sock);
+    expect += 1 + (step.op == RMA_AM_ZCOPY ? step.iters + RMA_LAT_ITERS : 0);
+
+    if (!is_sender) {
+      progress_until(&tp->engine, [tp, expect] { return tp->am_count >= expect; });
+      continue;
+    }
+
+    double start = GetTime();
+    for (long i = 0; i < step.iters; ++i) {
+      rma_post(tp, step, buf, memh, remote);
+    }
+    ep_flush(tp);
+    double rate_sec = GetTime() - start;
+
+    start = GetTime();
+    for (long i = 0; i < RMA_LAT_ITERS; ++i) {
+      rma_post(tp, step, buf, memh, remote);
+      ep_flush(tp);
+    }
+    double lat_sec = GetTime() - start;
+
+    uint64_t header = 0;
+    while ((status = uct_ep_am_short(tp->ep, DONE_AM_ID, header, NULL, 0)) == UCS_ERR_NO_RESOURCE) {
+      uct_worker_progress(tp->worker);
+    }
+    CHECK_UCS(status);
+
+    printf("%10s %10lu %10ld %10.3f %10.3f %10.2f\n", rma_op_names[step.op], step.size, step.iters,
+        step.iters / 1e6 / rate_sec, step.iters * step.size / 1e9 / rate_sec, lat_sec * 1e6 / RMA_LAT_ITERS);
+  }
+  ep_flush(tp);
+  barrier(oob_sock);
+
+  if (remote.rkey.rkey != UCT_INVALID_RKEY) {
+    uct_rkey_release(tp->component, &remote.rkey);
+  }
+  if (memh != UCT_MEM_HANDLE_NULL) {
+    uct_md_mem_dereg(tp->md, memh);
+  }
+  free(buf);
+}
+
+/*
+ * Build the atomic steps from the 32 and 64-bit capabilities both sides
+ * have. Each step runs rate_iters operations per thread.
+ */
+static void build_atomic_steps(const uct_iface_attr_t& iface_attr, int oob_sock) {
+  uint64_t own_flags[] = {iface_attr.cap.atomic32.op_flags, iface_attr.cap.atomic32.fop_flags,
+                          iface_attr.cap.atomic64.op_flags, iface_attr.cap.atomic64.fop_flags};
+  uint64_t* peer_flags;
+  sendrecv(oob_sock, own_flags, sizeof(own_flags), (void **)&peer_flags);
+
+  atomic_steps.clear();
+  for (int kind = ATOMIC_ADD; kind <= ATOMIC_CSWAP; ++kind) {
+    for (int bits = 32; bits <= 64; bits += 32) {
+      int idx = (bits == 64 ? 2 : 0) + (kind == ATOMIC_ADD ? 0 : 1);
+      uint64_t op = UCS_BIT(kind == ATOMIC_CSWAP ? UCT_ATOMIC_OP_CSWAP : UCT_ATOMIC_OP_ADD);
+      if (!(own_flags[idx] & peer_flags[idx] & op)) {
+        printf("Transport does not support %d-bit %s. Skipping.\n", bits, atomic_kind_names[kind]);
+        continue;
+      }
+      atomic_step step;
+      step.kind = (atomic_kind_t)kind;
+      step.bits = bits;
+      step.iters = rate_iters;
+      atomic_steps.push_back(step);
+    }
+  }
+  free(peer_flags);
+}
+
+static void atomic_completion_cb(uct_completion_t *self, ucs_status_t status) {
+  CHECK_UCS(status);
+  ((atomic_comp*)self)->done = true;
+}
+
+/*
+ * Run `n` compare-and-swaps one after the other, as a work claiming loop
+ * would: each one tries to move the counter from the value the previous one
+ * returned to the next value, so every op waits for the one before it. With
+ * contention some of them fail and only learn the current value.
+ */
+static void atomic_cswap_serial(transport* tp, const atomic_step& step, long n, const remote_buf& remote) {
+  ucs_status_t status;
+  uct_rkey_t rkey = remote.rkey.rkey;
+  uint64_t compare = 0;
+
+  for (long i = 0; i < n; ++i) {
+    uint64_t result = 0;
+    uint32_t result32 = 0;
+    atomic_comp comp;
+    comp.uct_comp.func = atomic_completion_cb;
+    comp.uct_comp.count = 1;
+    comp.done = false;
+    for (;;) {
+      status = step.bits == 64
+        ? uct_ep_atomic_cswap64(tp->ep, compare, compare + 1, remote.address, rkey, &result, &comp.uct_comp)
+        : uct_ep_atomic_cswap32(tp->ep, (uint32_t)compare, (uint32_t)compare + 1, remote.address, rkey, &result32,
+                                &comp.uct_comp);
+      if (status != UCS_ERR_NO_RESOURCE) break;
+      uct_worker_progress(tp->worker);
+    }
+    CHECK_COND(status == UCS_OK || status == UCS_INPROGRESS);
+    if (status == UCS_INPROGRESS) {
+      progress_until(&tp->engine, [&comp] { return comp.done; });
+    }
+
+    uint64_t old = step.bits == 64 ? result : result32;
+    compare = old == compare ? old + 1 : old;
+  }
+}
+
+/*
+ * Post `n` operations of `step` on the counter of the peer and wait until
+ * all of them completed: through the completion for fetching operations,
+ * through a flush for posted ones. cswap runs serially, see
+ * atomic_cswap_serial.
+ */
+static void atomic_batch(transport* tp, const atomic_step& step, long n, const remote_buf& remote) {
+  if (step.kind == ATOMIC_CSWAP) {
+    atomic_cswap_serial(tp, step, n, remote);
+    return;
+  }
+
+  ucs_status_t status;
+  uint64_t result = 0;
+  uint32_t result32 = 0;
+  uct_rkey_t rkey = remote.rkey.rkey;
+  atomic_comp comp;
+  comp.uct_comp.func = atomic_completion_cb;
+  comp.uct_comp.count = 1;
+  comp.done = false;
+
+  for (long i = 0; i < n; ++i) {
+    ++comp.uct_comp.count;
+    for (;;) {
+      if (step.kind == ATOMIC_ADD) {
+        status = step.bits == 64 ? uct_ep_atomic64_post(tp->ep, UCT_ATOMIC_OP_ADD, 1, remote.address, rkey)
+                                 : uct_ep_atomic32_post(tp->ep, UCT_ATOMIC_OP_ADD, 1, remote.address, rkey);
+      } else {
+        /* fetched values are not used, so all ops share one result buffer */
+        status = step.bits == 64
+          ? uct_ep_atomic64_fetch(tp->ep, UCT_ATOMIC_OP_ADD, 1, &result, remote.address, rkey, &comp.uct_comp)
+          : uct_ep_atomic32_fetch(tp->ep, UCT_ATOMIC_OP_ADD, 1, &result32, remote.address, rkey, &comp.uct_comp);
+      }
+      if (status != UCS_ERR_NO_RESOURCE) break;
+      uct_worker_progress(tp->worker);
+    }
+    CHECK_COND(status == UCS_OK || status == UCS_INPROGRESS);
+    if (status == UCS_OK) {
+      --comp.uct_comp.count;
+    }
+  }
+
+  if (step.kind == ATOMIC_ADD) {
+    ep_flush(tp);
+  } else if (--comp.uct_comp.count > 0) {
+    progress_until(&tp->engine, [&comp] { return comp.done; });
+  }
+}
+
+/*
+ * One thread of the atomic benchmark. Client threads run every step against
+ * the same server counter; server threads only progress until the client's
+ * end-of-step AM arrives.
+ */
+static void* atomic_thread(void* arg) {
+  transport* tp = (transport*)arg;
+  const remote_buf& remote = *tp->remote;
+  bind_thread(tp);
+
+  long expect = 0;
+  for (const atomic_step& step : atomic_steps) {
+    pthread_barrier_wait(&start_barrier);
+
+    if (is_sender) {
+      tp->start = GetTime();
+      atomic_batch(tp, step, step.iters, remote);
+      tp->end = GetTime();
+
+      double start = GetTime();
+      for (long i = 0; i < RMA_LAT_ITERS; ++i) {
+        atomic_batch(tp, step, 1, remote);
+      }
+      tp->op_lat = (GetTime() - start) / RMA_LAT_ITERS;
+
+      ucs_status_t status;
+      uint64_t header = 0;
+      while ((status = uct_ep_am_short(tp->ep, DONE_AM_ID, header, NULL, 0)) == UCS_ERR_NO_RESOURCE) {
+        uct_worker_progress(tp->worker);
+      }
+      CHECK_UCS(status);
+      ep_flush(tp);
+    } else {
+      ++expect;
+      progress_until(&tp->engine, [tp, expect] { return tp->am_count >= expect; });
+    }
+    pthread_barrier_wait(&done_barrier);
+  }
+  return NULL;
+}
+
+/*
+ * Remote atomic benchmark. Every side registers atomic_counter in the md of
+ * each of its transports, so all client threads hit the same server counter
+ * and runs with several threads are contended. For every step the client
+ * reports the aggregate rate and the average latency of a single operation.
+ */
+static void run_atomic(std::vector<transport>& tps, int oob_sock) {
+  ucs_status_t status;
+
+  build_atomic_steps(tps[0].iface_attr, oob_sock);
+  atomic_counter[0] = 0;
+
+  std::vector<uct_mem_h> memhs(tps.size());
+  std::vector<remote_buf> remotes(tps.size());
+  for (size_t i = 0; i < tps.size(); ++i) {
+    transport& tp = tps[i];
+    exchange_rkey(&tp, atomic_counter, sizeof(atomic_counter), UCT_MD_MEM_ACCESS_REMOTE_ATOMIC, &memhs[i],
+                  &remotes[i], oob_sock);
+    tp.am_count = 0;
+    tp.am_target = -1;
+    tp.remote = &remotes[i];
+    status = uct_iface_set_am_handler(tp.iface, DONE_AM_ID, am_count_handler, &tp, 0);
+    CHECK_UCS(status);
+  }
+
+  pthread_barrier_init(&start_barrier, NULL, tps.size() + 1);
+  pthread_barrier_init(&done_barrier, NULL, tps.size() + 1);
+  for (transport& tp : tps) {
+    pthread_create(&tp.thread, NULL, atomic_thread, &tp);
+  }
+
+  printf("%s remote atomics on %ld threads\n", is_sender ? "Issuing" : "Serving", tps.size());
+  if (is_sender) printf("%6s %6s %10s %10s %10s\n", "op", "bits", "iters", "Mops/s", "lat (us)");
+  for (const atomic_step& step : atomic_steps) {
+    barrier(oob_sock);
+    pthread_barrier_wait(&start_barrier);
+    pthread_barrier_wait(&done_barrier);
+    if (!is_sender) continue;
+
+    double start = tps[0].start, end = tps[0].end, lat = 0;
+    for (transport& tp : tps) {
+      start = std::min(start, tp.start);
+      end = std::max(end, tp.end);
+      lat += tp.op_lat / tps.size();
+    }
+    printf("%6s %6d %10ld %10.3f %10.2f\n", atomic_kind_names[step.kind], step.bits, step.iters,
+        step.iters * tps.size() / 1e6 / (end - start), lat * 1e6);
+  }
+
+  for (transport& tp : tps) {
+    pthread_join(tp.thread, NULL);
+    tp.remote = NULL;
+  }
+  pthread_barrier_destroy(&start_barrier);
+  pthread_barrier_destroy(&done_barrier);
+  barrier(oob_sock);
+  if (!is_sender) {
+    printf("Final counter value: %lu\n", atomic_counter[0]);
+  }
+
+  for (size_t i = 0; i < tps.size(); ++i) {
+    if (remotes[i].rkey.rkey != UCT_INVALID_RKEY) {
+      uct_rkey_release(tps[i].component, &remotes[i].rkey);
+    }
+    if (memhs[i] != UCT_MEM_HANDLE_NULL) {
+      uct_md_mem_dereg(tps[i].md, memhs[i]);
+    }
+  }
+}
+
+/*
+ * Flush the endpoint with a completion and wait for it, or poll the iface
+ * flush until it returns UCS_OK: most ifaces do not accept a completion for
+ * uct_iface_flush. Returns the seconds from the first flush call to
+ * completion.
+ */
+static double flush_wait(transport* tp, bool iface) {
+  ucs_status_t status;
+  double start = GetTime();
+  if (iface) {
+    while ((status = uct_iface_flush(tp->iface, 0, NULL)) != UCS_OK) {
+      if (status != UCS_INPROGRESS && status != UCS_ERR_NO_RESOURCE) CHECK_UCS(status);
+      uct_worker_progress(tp->worker);
+    }
+    return GetTime() - start;
+  }
+
+  atomic_comp comp;
+  comp.uct_comp.func = atomic_completion_cb;
+  comp.uct_comp.count = 1;
+  comp.done = false;
+  for (;;) {
+    status = uct_ep_flush(tp->ep, 0, &comp.uct_comp);
+    if (status != UCS_ERR_NO_RESOURCE) break;
+    uct_worker_progress(tp->worker);
+  }
+  if (status == UCS_INPROGRESS) {
+    progress_until(&tp->engine, [&comp] { return comp.done; });
+  } else {
+    CHECK_UCS(status);
+  }
+  return GetTime() - start;
+}
+
+/*
+ * Flush and fence cost. The client posts K 8-byte puts (put_short, or
+ * put_bcopy if short is not supported on both sides), then flushes with
+ * uct_ep_flush or uct_iface_flush and records the time until the flush
+ * completes, for K from 0 to FLUSH_MAX_OUTSTANDING. It then compares the
+ * rate of pairs of puts with and without uct_ep_fence between them. The
+ * server only progresses, as in run_rma, until the client's done message.
+ */
+static void run_flush(transport* tp, int oob_sock) {
+  ucs_status_t status;
+  const uct_iface_attr_t& a = tp->iface_attr;
+
+  rma_step step;
+  step.size = sizeof(uint64_t);
+  if (agree(oob_sock, (a.cap.flags & UCT_IFACE_FLAG_PUT_SHORT) && a.cap.put.max_short >= step.size)) {
+    step.op = RMA_PUT_SHORT;
+  } else if (agree(oob_sock, (a.cap.flags & UCT_IFACE_FLAG_PUT_BCOPY) && a.cap.put.max_bcopy >= step.size)) {
+    step.op = RMA_PUT_BCOPY;
+  } else {
+    printf("Transport does not support put. Skipping.\n");
+    return;
+  }
+
+  char* buf = (char*)calloc(1, step.size);
+  uct_mem_h memh;
+  remote_buf remote;
+  exchange_rkey(tp, buf, step.size, UCT_MD_MEM_ACCESS_RMA, &memh, &remote, oob_sock);
+
+  tp->am_count = 0;
+  tp->am_target = -1;
+  status = uct_iface_set_am_handler(tp->iface, DONE_AM_ID, am_count_handler, tp, 0);
+  CHECK_UCS(status);
+  barrier(oob_sock);
+
+  if (!is_sender) {
+    printf("Serving %s for remote access\n", rma_op_names[step.op]);
+    progress_until(&tp->engine, [tp] { return tp->am_count >= 1; });
+  } else {
+    printf("%6s %10s %6s %8s %10s %10s %10s %10s\n", "flush", "op", "K", "reps", "post (us)", "avg (us)",
+        "p50 (us)", "p99 (us)");
+    for (int iface = 0; iface <= 1; ++iface) {
+      for (long k = 0; k <= FLUSH_MAX_OUTSTANDING; k = k ? k * 4 : 1) {
+        long reps = std::max(10L, std::min(1000L, rate_iters / std::max(1L, k)));
+        latency_histogram hist;
+        hist_init(&hist);
+        double post_sec = 0, flush_sec = 0;
+        for (long r = 0; r < reps; ++r) {
+          double start = GetTime();
+          for (long i = 0; i < k; ++i) {
+            rma_post(tp, step, buf, memh, remote);
+          }
+          post_sec += GetTime() - start;
+          double sec = flush_wait(tp, iface);
+          flush_sec += sec;
+          hist_record(&hist, (uint64_t)(sec * 1e9));
+        }
+        printf("%6s %10s %6ld %8ld %10.2f %10.2f %10.2f %10.2f\n", iface ? "iface" : "ep", rma_op_names[step.op],
+            k, reps, post_sec * 1e6 / reps, flush_sec * 1e6 / reps, hist_percentile(&hist, 50) / 1e3,
+            hist_percentile(&hist, 99) / 1e3);
+      }
+    }
+
+    /*
+     * put, [fence,] put, ... and one flush at the end, so the difference is
+     * the cost of the fences alone.
+     */
+    long pairs = std::max(1L, rate_iters / 2);
+    double sec[2];
+    for (int fence = 0; fence <= 1; ++fence) {
+      double start = GetTime();
+      for (long i = 0; i < pairs; ++i) {
+        rma_post(tp, step, buf, memh, remote);
+        if (fence) {
+          status = uct_ep_fence(tp->ep, 0);
+          CHECK_UCS(status);
+        }
+        rma_post(tp, step, buf, memh, remote);
+      }
+      flush_wait(tp, false);
+      sec[fence] = GetTime() - start;
+    }
+    printf("%10s %10s %10s %10s\n", "pairs", "unfenced", "fenced", "fence (ns)");
+    printf("%10ld %10.3f %10.3f %10.1f\n", pairs, pairs * 2 / 1e6 / sec[0], pairs * 2 / 1e6 / sec[1],
+        (sec[1] - sec[0]) * 1e9 / pairs);
+    printf("(Mops/s unfenced and fenced, extra time per fence)\n");
+
+    uint64_t header = 0;
+    while ((status = uct_ep_am_short(tp->ep, DONE_AM_ID, header, NULL, 0)) == UCS_ERR_NO_RESOURCE) {
+      uct_worker_progress(tp->worker);
+    }
+    CHECK_UCS(status);
+    ep_flush(tp);
+  }
+  barrier(oob_sock);
+
+  if (remote.rkey.rkey != UCT_INVALID_RKEY) {
+    uct_rkey_release(tp->component, &remote.rkey);
+  }
+  if (memh != UCT_MEM_HANDLE_NULL) {
+    uct_md_mem_dereg(tp->md, memh);
+  }
+  free(buf);
+}
+
+/*
+ * Cost of registering a zcopy buffer before and deregistering it after every
+ * send, with and without the registration cache. "reused" sends from one
+ * buffer; "unique" cycles through buffers totalling twice the cache capacity,
+ * so every access misses and evicts. Local only, the peer runs the same.
+ */
+static void run_rcache(transport* tp) {
+  ucs_status_t status;
+
+  if (!(tp->md_attr.cap.flags & UCT_MD_FLAG_REG)) {
+    printf("Memory domain cannot register memory. Skipping.\n");
+    return;
+  }
+
+  printf("%10s %8s %6s %10s %10s %8s\n", "size", "buffers", "cache", "iters", "us/op", "hit%");
+  for (size_t size = 4096; size <= 4 * 1024 * 1024; size *= 16) {
+    size_t count = std::max((size_t)1, 2 * rcache_capacity / size);
+    char* pool = (char*)aligned_alloc(RCACHE_ALIGN, count * size);
+
+    for (int unique = 0; unique <= 1; ++unique) {
+      for (int cached = 0; cached <= 1; ++cached) {
+        rcache cache;
+        rcache_init(&cache, tp->md, UCT_MD_MEM_ACCESS_RMA, rcache_capacity);
+
+        double start = GetTime();
+        for (long i = 0; i < rcache_iters; ++i) {
+          char* buf = unique ? pool + (i % count) * size : pool;
+          if (cached) {
+            rcache_put(&cache, rcache_get(&cache, buf, size));
+          } else {
+            uct_mem_h memh;
+            status = uct_md_mem_reg(tp->md, buf, size, UCT_MD_MEM_ACCESS_RMA, &memh);
+            CHECK_UCS(status);
+            status = uct_md_mem_dereg(tp->md, memh);
+            CHECK_UCS(status);
+          }
+        }
+        double sec = GetTime() - start;
+
+        printf("%10lu %8s %6s %10ld %10.3f %8.1f\n", size, unique ? "unique" : "reused", cached ? "on" : "off",
+            rcache_iters, sec * 1e6 / rcache_iters, cached ? 100.0 * cache.hits / rcache_iters : 0.0);
+        rcache_cleanup(&cache);
+      }
+    }
+    free(pool);
+  }
+}
+
+/*
+ * Build the scatter/gather steps: for fragment sizes 64 B to 32 KiB and
+ * 1 to max_iov fragments (limits agreed with the peer), every method that
+ * can carry the whole message.
+ */
+static std::vector<iov_step> build_iov_steps(const uct_iface_attr_t& iface_attr, size_t* header_len, int oob_sock) {
+  const uct_iface_attr_t& a = iface_attr;
+  size_t own_caps[] = {a.cap.flags & UCT_IFACE_FLAG_AM_BCOPY ? a.cap.am.max_bcopy : 0,
+                       a.cap.flags & UCT_IFACE_FLAG_AM_ZCOPY ? a.cap.am.max_zcopy : 0,
+                       a.cap.am.max_iov, a.cap.am.max_hdr};
+  size_t* peer_caps;
+  sendrecv(oob_sock, own_caps, sizeof(own_caps), (void **)&peer_caps);
+  size_t caps[4];
+  for (int i = 0; i < 4; ++i) caps[i] = std::min(own_caps[i], peer_caps[i]);
+  free(peer_caps);
+
+  *header_len = std::min(IOV_HDR_LEN, caps[3]);
+  int max_iov = std::min((size_t)IOV_MAX_FRAGS, caps[2]);
+  std::vector<iov_step> steps;
+  for (size_t frag_size = 64; frag_size <= 32 * 1024; frag_size *= 8) {
+    for (int nfrags = 1; nfrags <= IOV_MAX_FRAGS; nfrags *= 2) {
+      size_t len = *header_len + nfrags * frag_size;
+      for (int method = IOV_BCOPY; method <= IOV_STRIDED; ++method) {
+        if (method == IOV_BCOPY ? len > caps[0] :
+            len > caps[1] || len < a.cap.am.min_zcopy || (method == IOV_GATHER && nfrags > max_iov)) {
+          continue;
+        }
+        iov_step step;
+        step.method = (iov_send_t)method;
+        step.frag_size = frag_size;
+        step.nfrags = nfrags;
+        step.iters = std::min(rate_iters, std::max(1L, (long)(rate_max_bytes / len)));
+        steps.push_back(step);
+      }
+    }
+  }
+  return steps;
+}
+
+static void iov_send(transport* tp, const iov_step& step, const gather_args& args, uct_mem_h memh) {
+  ucs_status_t status;
+  uct_iov_t iov[IOV_MAX_FRAGS];
+  size_t iovcnt;
+
+  if (step.method == IOV_GATHER) {
+    for (int i = 0; i < step.nfrags; ++i) {
+      iov[i].buffer = (void*)(args.base + i * args.stride);
+      iov[i].length = args.frag_size;
+      iov[i].memh   = memh;
+      iov[i].stride = 0;
+      iov[i].count  = 1;
+    }
+    iovcnt = step.nfrags;
+  } else {
+    iov[0].buffer = (void*)args.base;
+    iov[0].length = args.frag_size;
+    iov[0].memh   = memh;
+    iov[0].stride = args.stride;
+    iov[0].count  = step.nfrags;
+    iovcnt = 1;
+  }
+
+  for (long i = 0; i < step.iters; ++i) {
+    if (step.method == IOV_BCOPY) {
+      ssize_t len;
+      while ((len = uct_ep_am_bcopy(tp->ep, RATE_AM_ID, gather_packer, (void*)&args, 0)) == UCS_ERR_NO_RESOURCE) {
+        uct_worker_progress(tp->worker);
+      }
+      CHECK_UCS(len >= 0 ? UCS_OK : (ucs_status_t)len);
+    } else {
+      while ((status = uct_ep_am_zcopy(tp->ep, RATE_AM_ID, args.header, args.header_len, iov, iovcnt, 0,
+                                       NULL)) == UCS_ERR_NO_RESOURCE) {
+        uct_worker_progress(tp->worker);
+      }
+      CHECK_COND(status == UCS_OK || status == UCS_INPROGRESS);
+    }
+  }
+  ep_flush(tp);
+}
+
+/*
+ * What the receiver of the stride check expects: `nfrags` fragments of
+ * `frag_size` bytes after the header, fragment i filled with i + 1.
+ */
+struct iov_check {
+  size_t header_len;
+  size_t frag_size;
+  int nfrags;
+  bool seen, ok;
+};
+
+static ucs_status_t iov_check_handler(void *arg, void *data, size_t length, unsigned flags) {
+  iov_check* check = (iov_check*)arg;
+  const char* payload = (const char*)data + check->header_len;
+  check->ok = length == check->header_len + check->nfrags * check->frag_size;
+  for (size_t i = 0; check->ok && i < check->nfrags * check->frag_size; ++i) {
+    check->ok = payload[i] == (char)(i / check->frag_size + 1);
+  }
+  check->seen = true;
+  return UCS_OK;
+}
+
+/*
+ * Send one strided message of `step`'s layout, with the gaps zeroed, and let
+ * the receiver check that only the fragments arrived. Many transports ignore
+ * uct_iov_t.stride and count and send the region contiguously instead.
+ */
+static bool check_iov_stride(transport* tp, const iov_step& step, const gather_args& args, uct_mem_h memh,
+                             char* base, int oob_sock) {
+  ucs_status_t status;
+  iov_check check;
+  check.header_len = args.header_len;
+  check.frag_size = step.frag_size;
+  check.nfrags = step.nfrags;
+  check.seen = check.ok = false;
+  status = uct_iface_set_am_handler(tp->iface, IOV_CHECK_AM_ID, iov_check_handler, &check, 0);
+  CHECK_UCS(status);
+  barrier(oob_sock);
+
+  if (is_sender) {
+    for (int i = 0; i < step.nfrags; ++i) {
+      memset(base + i * args.stride, i + 1, step.frag_size);
+      memset(base + i * args.stride + step.frag_size, 0, args.stride - step.frag_size);
+    }
+    uct_iov_t iov;
+    iov.buffer = base;
+    iov.length = step.frag_size;
+    iov.memh   = memh;
+    iov.stride = args.stride;
+    iov.count  = step.nfrags;
+    while ((status = uct_ep_am_zcopy(tp->ep, IOV_CHECK_AM_ID, args.header, args.header_len, &iov, 1, 0,
+                                     NULL)) == UCS_ERR_NO_RESOURCE) {
+      uct_worker_progress(tp->worker);
+    }
+    CHECK_COND(status == UCS_OK || status == UCS_INPROGRESS);
+    ep_flush(tp);
+    check.ok = true;
+  } else {
+    progress_until(&tp->engine, [&check] { return check.seen; });
+  }
+  return agree(oob_sock, check.ok);
+}
+
+/*
+ * Scatter/gather send benchmark. A message is a short header plus several
+ * fragments spread over a source region, one fragment-size gap apart. It is
+ * sent with one uct_ep_am_zcopy call, either with one iov per fragment or
+ * with one strided iov, or packed into the bounce buffer by bcopy. The
+ * strided rows only run if a check message shows that the transport honors
+ * the stride.
+ */
+static void run_iov(transport* tp, int oob_sock) {
+  ucs_status_t status;
+
+  size_t header_len;
+  std::vector<iov_step> steps = build_iov_steps(tp->iface_attr, &header_len, oob_sock);
+  size_t region = 0;
+  for (const iov_step& step : steps) {
+    region = std::max(region, 2 * step.frag_size * step.nfrags);
+  }
+  char header[IOV_HDR_LEN] = {0};
+  char* base = (char*)calloc(1, std::max(region, (size_t)1));
+
+  uct_mem_h memh = UCT_MEM_HANDLE_NULL;
+  if (is_sender && region > 0 && (tp->md_attr.cap.flags & UCT_MD_FLAG_NEED_MEMH)) {
+    status = uct_md_mem_reg(tp->md, base, region, UCT_MD_MEM_ACCESS_RMA, &memh);
+    CHECK_UCS(status);
+  }
+  status = uct_iface_set_am_handler(tp->iface, RATE_AM_ID, am_count_handler, tp, 0);
+  CHECK_UCS(status);
+
+  for (const iov_step& step : steps) {
+    if (step.method != IOV_STRIDED || step.nfrags < 2) continue;
+    gather_args args;
+    args.header = header;
+    args.header_len = header_len;
+    args.base = base;
+    args.frag_size = step.frag_size;
+    args.stride = 2 * step.frag_size;
+    args.nfrags = step.nfrags;
+    args.nt_threshold = pack_nt_threshold(tp);
+    if (!check_iov_stride(tp, step, args, memh, base, oob_sock)) {
+      printf("Transport does not honor uct_iov_t stride. Skipping strided.\n");
+      steps.erase(std::remove_if(steps.begin(), steps.end(),
+                                 [](const iov_step& s) { return s.method == IOV_STRIDED; }), steps.end());
+    }
+    break;
+  }
+
+  if (is_sender) {
+    printf("%8s %10s %6s %10s %10s %10s %10s\n", "method", "frag", "frags", "msg size", "iters", "Mmsg/s", "GB/s");
+  }
+  for (const iov_step& step : steps) {
+    gather_args args;
+    args.header = header;
+    args.header_len = header_len;
+    args.base = base;
+    args.frag_size = step.frag_size;
+    args.stride = 2 * step.frag_size;
+    args.nfrags = step.nfrags;
+    args.nt_threshold = pack_nt_threshold(tp);
+    size_t len = header_len + step.nfrags * step.frag_size;
+
+    tp->am_count = 0;
+    tp->am_target = step.iters;
+    barrier(oob_sock);
+    if (is_sender) {
+      double start = GetTime();
+      iov_send(tp, step, args, memh);
+      double sec = GetTime() - start;
+      printf("%8s %10lu %6d %10lu %10ld %10.3f %10.3f\n", iov_send_names[step.method], step.frag_size, step.nfrags,
+          len, step.iters, step.iters / 1e6 / sec, step.iters * len / 1e9 / sec);
+    } else {
+      progress_until(&tp->engine, [tp] { return tp->am_count >= tp->am_target; });
+    }
+  }
+  barrier(oob_sock);
+
+  if (memh != UCT_MEM_HANDLE_NULL) {
+    uct_md_mem_dereg(tp->md, memh);
+  }
+  free(base);
+}
+
+/*
+ * Packer copy throughput per variant, for contiguous sources and for a
+ * scatter list of 8 fragments. The destination cycles through a 64 MiB ring
+ * so it is not cache resident, like a transport bounce buffer that another
+ * process or the NIC reads. Local only, the peer runs the same.
+ */
+static void run_packer(transport* tp) {
+  const size_t ring_size = 64 * 1024 * 1024;
+  const int nfrags = 8;
+  const size_t max_size = 4 * 1024 * 1024;
+  char* src = (char*)aligned_alloc(64, 2 * max_size);
+  char* ring = (char*)aligned_alloc(64, ring_size);
+  memset(src, 1, 2 * max_size);
+  memset(ring, 0, ring_size);
+
+  printf("auto streams from %lu bytes\n", tp->copy_nt_threshold);
+  printf("%10s %6s %10s %10s\n", "size", "frags", "variant", "GB/s");
+  for (size_t size = 1024; size <= max_size; size *= 4) {
+    for (int frags = 1; frags <= nfrags; frags *= nfrags) {
+      copy_frag list[nfrags];
+      for (int i = 0; i < frags; ++i) {
+        list[i].data = src + 2 * i * (size / frags);
+        list[i].len = size / frags;
+      }
+
+      for (int variant = COPY_MEMCPY; variant <= COPY_AUTO; ++variant) {
+        copy_fn_t copy = copy_select((copy_variant_t)variant);
+        if (copy == NULL) continue;
+
+        long iters = std::max(1L, (long)(rate_max_bytes / size));
+        size_t offset = 0;
+        double start = GetTime();
+        for (long i = 0; i < iters; ++i) {
+          copy_gather(copy, variant == COPY_AUTO ? tp->copy_nt_threshold : 0, ring + offset, list, frags);
+          offset = offset + 2 * size > ring_size ? 0 : offset + size;
+        }
+        double sec = GetTime() - start;
+        printf("%10lu %6d %10s %10.3f\n", size, frags, copy_variant_names[variant], iters * size / 1e9 / sec);
+      }
+    }
+  }
+  free(ring);
+  free(src);
+}
+
+/*
+ * Bursty sends over sched_num_eps endpoints of one iface. Every burst submits
+ * SCHED_BURST messages per endpoint, interleaved. "busy" retries each send
+ * with uct_worker_progress until it is accepted, the way the other benchmarks
+ * do; "sched" hands it to the send scheduler (sched.h) and progresses until
+ * the queues drain. For both, the client reports the rate, the share of time
+ * the application was stuck in send calls, and the delay from submitting a
+ * message to posting it.
+ */
+static void run_sched(transport* tp, int oob_sock) {
+  ucs_status_t status;
+  const uct_iface_attr_t& a = tp->iface_attr;
+
+  /*
+   * sched_post sends short up to max_short and bcopy above
+   */
+  bool fits = pingpong_size >= sizeof(uint64_t) &&
+              (((a.cap.flags & UCT_IFACE_FLAG_AM_SHORT) && pingpong_size <= a.cap.am.max_short) ||
+               ((a.cap.flags & UCT_IFACE_FLAG_AM_BCOPY) && pingpong_size <= a.cap.am.max_bcopy));
+  if (!agree(oob_sock, fits)) {
+    printf("Transport does not support %lu byte short or bcopy active messages. Skipping.\n", pingpong_size);
+    return;
+  }
+
+  /*
+   * One endpoint pair per connect_ep call. Both sides see the same result, so
+   * they stop adding endpoints together.
+   */
+  std::vector<uct_ep_h> eps(1, tp->ep);
+  for (int i = 1; i < sched_num_eps; ++i) {
+    uct_ep_h ep;
+    if (!connect_ep(tp, oob_sock, false, &ep)) {
+      printf("Could not connect endpoint %d. Continuing with %lu.\n", i, eps.size());
+      break;
+    }
+    eps.push_back(ep);
+  }
+
+  status = uct_iface_set_am_handler(tp->iface, RATE_AM_ID, am_count_handler, tp, 0);
+  CHECK_UCS(status);
+
+  long bursts = std::max(1L, rate_iters / SCHED_BURST);
+  long total = bursts * SCHED_BURST * eps.size();
+  char* buf = (char*)calloc(1, pingpong_size);
+
+  if (is_sender) {
+    printf("%s: %lu byte messages, %lu endpoints, bursts of %ld per endpoint\n",
+        tp->iface_attr.cap.flags & UCT_IFACE_FLAG_PENDING ? "pending queue" : "no pending queue, polling",
+        pingpong_size, eps.size(), SCHED_BURST);
+    printf("%6s %10s %10s %10s %10s %10s %10s\n", "mode", "Mmsg/s", "blocked%", "p50 (us)", "p99 (us)",
+        "p99.9 (us)", "max (us)");
+  }
+  for (int use_sched = 0; use_sched <= 1; ++use_sched) {
+    tp->am_count = 0;
+    tp->am_target = total;
+    barrier(oob_sock);
+
+    if (!is_sender) {
+      progress_until(&tp->engine, [tp] { return tp->am_count >= tp->am_target; });
+      continue;
+    }
+
+    send_sched sched;
+    sched_init(&sched, tp->worker, tp->iface_attr);
+    std::vector<sched_ep*> seps;
+    for (uct_ep_h ep : eps) {
+      seps.push_back(sched_add_ep(&sched, ep));
+    }
+    latency_histogram busy_delay;
+    hist_init(&busy_delay);
+
+    double blocked = 0;
+    double start = GetTime();
+    for (long b = 0; b < bursts; ++b) {
+      for (long j = 0; j < SCHED_BURST; ++j) {
+        for (size_t e = 0; e < eps.size(); ++e) {
+          double submitted = GetTime();
+          if (use_sched) {
+            sched_send(seps[e], RATE_AM_ID, buf, pingpong_size);
+          } else {
+            sched_msg msg;
+            msg.id = RATE_AM_ID;
+            msg.data = buf;
+            msg.len = pingpong_size;
+            while ((status = sched_post(seps[e], msg)) == UCS_ERR_NO_RESOURCE) {
+              uct_worker_progress(tp->worker);
+            }
+            CHECK_UCS(status);
+            hist_record(&busy_delay, (uint64_t)((GetTime() - submitted) * 1e9));
+          }
+          blocked += GetTime() - submitted;
+        }
+      }
+      while (!sched_idle(&sched)) {
+        sched_progress(&sched);
+      }
+    }
+    for (uct_ep_h ep : eps) {
+      ep_flush(tp, ep);
+    }
+    double sec = GetTime() - start;
+
+    latency_histogram* h = use_sched ? &sched.delay : &busy_delay;
+    printf("%6s %10.3f %10.1f %10.2f %10.2f %10.2f %10.2f\n", use_sched ? "sched" : "busy", total / 1e6 / sec,
+        100 * blocked / sec, hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3,
+        hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+    if (use_sched) {
+      sched_print(&sched);
+    }
+    sched_cleanup(&sched);
+  }
+  barrier(oob_sock);
+
+  for (size_t i = 1; i < eps.size(); ++i) {
+    uct_ep_destroy(eps[i]);
+  }
+  free(buf);
+}
+
+static uint8_t rpc_null_handler(void* arg, const void* req, size_t len, void* resp, size_t max_resp,
+                                size_t* resp_len) {
+  *resp_len = 0;
+  return 0;
+}
+
+static void rpc_null_done(void* arg, uint8_t status, const void* resp, size_t len) {
+}
+
+/*
+ * Null RPC rate through rpc.h: empty requests answered with empty responses,
+ * with 1 (latency bound), 16 and 128 calls in flight. pingpong_iters calls
+ * per window.
+ */
+static void run_rpc(transport* tp, int oob_sock) {
+  if (!agree(oob_sock, tp->iface_attr.cap.flags & UCT_IFACE_FLAG_AM_SHORT)) {
+    printf("Transport does not support short active messages. Skipping.\n");
+    return;
+  }
+
+  rpc_ctx* ctx = new rpc_ctx;
+  rpc_init(ctx, tp->worker, tp->ep, tp->iface_attr);
+  rpc_register(ctx, tp->iface, RPC_NULL_AM_ID, rpc_null_handler, NULL);
+
+  if (is_sender) printf("%8s %10s %10s %10s\n", "window", "calls", "Mrpc/s", "us/rpc");
+  const long windows[] = {1, 16, 128};
+  long served = 0;
+  for (long window : windows) {
+    barrier(oob_sock);
+    if (!is_sender) {
+      served += pingpong_iters;
+      progress_until(&tp->engine, [ctx, served] { return rpc_progress(ctx) && ctx->served >= served; });
+      continue;
+    }
+
+    long issued = 0;
+    long completed = ctx->completed;
+    double start = GetTime();
+    while (ctx->completed - completed < pingpong_iters) {
+      while (issued < pingpong_iters && issued - (ctx->completed - completed) < window &&
+             rpc_call(ctx, RPC_NULL_AM_ID, NULL, 0, rpc_null_done, NULL) == UCS_OK) {
+        ++issued;
+      }
+      rpc_progress(ctx);
+    }
+    double sec = GetTime() - start;
+    printf("%8ld %10ld %10.3f %10.2f\n", window, pingpong_iters, pingpong_iters / 1e6 / sec,
+        sec * 1e6 / pingpong_iters);
+  }
+  barrier(oob_sock);
+  if (ctx->stale > 0) printf("%ld stale responses\n", ctx->stale);
+  delete ctx;
+}
+
+enum tag_proto_t {
+  TAG_EAGER,
+  TAG_RNDV
+};
+
+struct tag_step {
+  tag_proto_t proto;
+  size_t size;
+  long depth;     // messages per credit
+  long batches;
+};
+
+/*
+ * Receive slot of the tag benchmark. The same context is posted to
+ * uct_iface_tag_recv_zcopy or to the software matcher.
+ */
+struct tag_slot {
+  uct_tag_context_t ctx;  // must be first
+  transport* tp;
+  bool posted;
+};
+
+static void tag_consumed_cb(uct_tag_context_t *self) {
+}
+
+static void tag_completed_cb(uct_tag_context_t *self, uct_tag_t stag, uint64_t imm, size_t length,
+                             void *inline_data, ucs_status_t status) {
+  tag_slot* slot = (tag_slot*)self;
+  CHECK_UCS(status);
+  slot->posted = false;
+  ++slot->tp->am_count;
+}
+
+static void tag_sw_rndv_cb(uct_tag_context_t *self, uct_tag_t stag, const void *header, unsigned header_length,
+                           ucs_status_t status, unsigned flags) {
+  printf("Offloaded receive got a software rendezvous request, not supported\n");
+  tag_completed_cb(self, stag, 0, 0, NULL, UCS_ERR_UNSUPPORTED);
+}
+
+/*
+ * Build the eager (powers of two up to the eager limit) and rendezvous
+ * (8 KiB to 4 MiB) steps from the limits both sides have.
+ */
+static std::vector<tag_step> build_tag_steps(const uct_iface_attr_t& a, bool hw, int oob_sock) {
+  size_t own_caps[3];
+  if (hw) {
+    own_caps[0] = a.cap.tag.eager.max_bcopy;
+    own_caps[1] = a.cap.flags & UCT_IFACE_FLAG_TAG_RNDV_ZCOPY ? a.cap.tag.rndv.max_zcopy : 0;
+    own_caps[2] = a.cap.tag.recv.max_outstanding;
+  } else {
+    own_caps[0] = a.cap.flags & UCT_IFACE_FLAG_AM_BCOPY ? a.cap.am.max_bcopy - sizeof(uct_tag_t) : 0;
+    own_caps[1] = (a.cap.flags & UCT_IFACE_FLAG_GET_ZCOPY) && (a.cap.flags & UCT_IFACE_FLAG_AM_SHORT) &&
+                  a.cap.am.max_short >= sizeof(uct_tag_t) + sizeof(sw_tm_rts) ? a.cap.get.max_zcopy : 0;
+    own_caps[2] = TAG_DEPTH;
+  }
+  size_t* peer_caps;
+  sendrecv(oob_sock, own_caps, sizeof(own_caps), (void **)&peer_caps);
+  size_t eager_max = std::min(own_caps[0], peer_caps[0]);
+  size_t rndv_max = std::min((size_t)4 * 1024 * 1024, std::min(own_caps[1], peer_caps[1]));
+  long depth_max = std::min((size_t)TAG_DEPTH, std::min(own_caps[2], peer_caps[2]));
+  free(peer_caps);
+
+  std::vector<tag_step> steps;
+  for (int proto = TAG_EAGER; proto <= TAG_RNDV && depth_max > 0; ++proto) {
+    size_t min_size = proto == TAG_EAGER ? sizeof(uint64_t) : 8 * 1024;
+    size_t max_size = proto == TAG_EAGER ? eager_max : rndv_max;
+    if (max_size < min_size) {
+      printf("Transport does not support %s tagged sends. Skipping.\n", proto == TAG_EAGER ? "eager" : "rndv");
+      continue;
+    }
+    for (size_t size = min_size; ; size = std::min(size * 2, max_size)) {
+      tag_step step;
+      step.proto = (tag_proto_t)proto;
+      step.size = size;
+      step.depth = std::min((long)depth_max, std::max(1L, (long)(64 * 1024 * 1024 / size)));
+      long iters = std::min(rate_iters, std::max(1L, (long)(rate_max_bytes / size)));
+      step.batches = std::max(1L, iters / step.depth);
+      steps.push_back(step);
+      if (size == max_size) break;
+    }
+  }
+  return steps;
+}
+
+static void tag_send_credit(transport* tp) {
+  ucs_status_t status;
+  uint64_t header = 0;
+  while ((status = uct_ep_am_short(tp->ep, TAG_CREDIT_AM_ID, header, NULL, 0)) == UCS_ERR_NO_RESOURCE) {
+    uct_worker_progress(tp->worker);
+  }
+  CHECK_UCS(status);
+}
+
+/*
+ * Tagged send benchmark, offloaded (uct_iface_tag_recv_zcopy and
+ * uct_ep_tag_*) when both ifaces advertise eager tag offload, and through
+ * the software matcher in swtm.h otherwise. The receiver posts a batch of
+ * receives, then grants the sender a credit for it, so messages are expected
+ * on both paths. The sender's time ends with the credit that follows the last
+ * batch.
+ */
+static void run_tag(transport* tp, int oob_sock) {
+  ucs_status_t status;
+  const uct_iface_attr_t& a = tp->iface_attr;
+  bool hw = agree(oob_sock, a.cap.flags & UCT_IFACE_FLAG_TAG_EAGER_BCOPY);
+
+  std::vector<tag_step> steps = build_tag_steps(a, hw, oob_sock);
+  size_t max_size = sizeof(uint64_t);
+  for (const tag_step& step : steps) {
+    max_size = std::max(max_size, step.size);
+  }
+
+  char* buf = (char*)calloc(1, max_size);
+  uct_mem_h memh;
+  remote_buf remote;
+  exchange_rkey(tp, buf, max_size, UCT_MD_MEM_ACCESS_RMA, &memh, &remote, oob_sock);
+
+  sw_tm tm;
+  if (!hw) {
+    sw_tm_init(&tm, tp->iface, tp->ep, remote.rkey.rkey, TAG_EAGER_AM_ID, TAG_RTS_AM_ID);
+  }
+  status = uct_iface_set_am_handler(tp->iface, TAG_CREDIT_AM_ID, am_count_handler, tp, 0);
+  CHECK_UCS(status);
+  tp->am_target = -1;
+
+  std::vector<tag_slot> slots(TAG_DEPTH);
+  for (tag_slot& slot : slots) {
+    slot.ctx.tag_consumed_cb = tag_consumed_cb;
+    slot.ctx.completed_cb = tag_completed_cb;
+    slot.ctx.rndv_cb = tag_sw_rndv_cb;
+    slot.tp = tp;
+    slot.posted = false;
+  }
+
+  if (is_sender) {
+    printf("Tag matching in %s\n", hw ? "hardware" : "software");
+    printf("%6s %10s %6s %10s %10s %10s\n", "proto", "size", "depth", "iters", "Mmsg/s", "GB/s");
+  }
+  for (const tag_step& step : steps) {
+    tp->am_count = 0;
+
+    if (is_sender) {
+      barrier(oob_sock);
+      atomic_comp comp;
+      comp.uct_comp.func = atomic_completion_cb;
+      comp.uct_comp.count = 1;
+      comp.done = false;
+
+      uct_iov_t iov;
+      iov.buffer = buf;
+      iov.length = step.size;
+      iov.memh   = memh;
+      iov.stride = 0;
+      iov.count  = 1;
+      bcopy_args args;
+      args.data = buf;
+      args.len = step.size;
+      args.nt_threshold = pack_nt_threshold(tp);
+
+      double start = GetTime();
+      for (long b = 0; b < step.batches; ++b) {
+        progress_until(&tp->engine, [tp, b] { return tp->am_count > b; });
+        for (long i = 0; i < step.depth; ++i) {
+          for (;;) {
+            if (step.proto == TAG_EAGER) {
+              ssize_t len = hw ? uct_ep_tag_eager_bcopy(tp->ep, TAG_VALUE, 0, bcopy_packer, &args, 0)
+                               : sw_tm_eager_send(&tm, TAG_VALUE, buf, step.size);
+              status = len >= 0 ? UCS_OK : (ucs_status_t)len;
+            } else if (hw) {
+              uint64_t header = 0;
+              ++comp.uct_comp.count;
+              ucs_status_ptr_t op = uct_ep_tag_rndv_zcopy(tp->ep, TAG_VALUE, &header, sizeof(header), &iov, 1, 0,
+                                                          &comp.uct_comp);
+              status = UCS_PTR_IS_ERR(op) ? UCS_PTR_STATUS(op) : UCS_OK;
+              if (status != UCS_OK) --comp.uct_comp.count;
+            } else {
+              status = sw_tm_rndv_send(&tm, TAG_VALUE, buf, step.size);
+            }
+            if (status != UCS_ERR_NO_RESOURCE) break;
+            uct_worker_progress(tp->worker);
+          }
+          CHECK_UCS(status);
+        }
+      }
+      progress_until(&tp->engine, [tp, &step] { return tp->am_count > step.batches; });
+      double sec = GetTime() - start;
+
+      if (--comp.uct_comp.count > 0) {
+        progress_until(&tp->engine, [&comp] { return comp.done; });
+      }
+      ep_flush(tp);
+      long iters = step.batches * step.depth;
+      printf("%6s %10lu %6ld %10ld %10.3f %10.3f\n", step.proto == TAG_EAGER ? "eager" : "rndv", step.size,
+          step.depth, iters, iters / 1e6 / sec, iters * step.size / 1e9 / sec);
+      continue;
+    }
+
+    size_t slot_size = std::max(step.size, hw ? a.cap.tag.recv.min_recv : 0);
+    char* region = (char*)calloc(step.depth, slot_size);
+    uct_mem_h region_memh = UCT_MEM_HANDLE_NULL;
+    if (tp->md_attr.cap.flags & UCT_MD_FLAG_REG) {
+      status = uct_md_mem_reg(tp->md, region, step.depth * slot_size, UCT_MD_MEM_ACCESS_RMA, &region_memh);
+      CHECK_UCS(status);
+    }
+    barrier(oob_sock);
+
+    for (long b = 0; b < step.batches; ++b) {
+      for (long i = 0; i < step.depth; ++i) {
+        char* slot_buf = region + i * slot_size;
+        if (hw) {
+          uct_iov_t iov;
+          iov.buffer = slot_buf;
+          iov.length = slot_size;
+          iov.memh   = region_memh;
+          iov.stride = 0;
+          iov.count  = 1;
+          status = uct_iface_tag_recv_zcopy(tp->iface, TAG_VALUE, (uct_tag_t)-1, &iov, 1, &slots[i].ctx);
+          CHECK_UCS(status);
+        } else {
+          sw_tm_post(&tm, TAG_VALUE, (uct_tag_t)-1, slot_buf, slot_size, region_memh, &slots[i].ctx);
+        }
+        slots[i].posted = true;
+      }
+      tag_send_credit(tp);
+      long expect = (b + 1) * step.depth;
+      progress_until(&tp->engine, [&] {
+        if (!hw) sw_tm_progress(&tm);
+        return tp->am_count >= expect;
+      });
+    }
+    tag_send_credit(tp);
+
+    for (tag_slot& slot : slots) {
+      if (slot.posted && hw) {
+        uct_iface_tag_recv_cancel(tp->iface, &slot.ctx, 1);
+      }
+      slot.posted = false;
+    }
+    if (region_memh != UCT_MEM_HANDLE_NULL) {
+      uct_md_mem_dereg(tp->md, region_memh);
+    }
+    free(region);
+  }
+  barrier(oob_sock);
+
+  long unexpected = hw ? tp->tag_unexpected : tm.unexpected_count;
+  if (unexpected > 0) printf("%ld unexpected tagged messages\n", unexpected);
+  if (remote.rkey.rkey != UCT_INVALID_RKEY) {
+    uct_rkey_release(tp->component, &remote.rkey);
+  }
+  if (memh != UCT_MEM_HANDLE_NULL) {
+    uct_md_mem_dereg(tp->md, memh);
+  }
+  free(buf);
+}
+
+/*
+ * Short probe used to rank transports: p50 latency of 8 byte pings, and
+ * bandwidth of the largest zcopy (or bcopy) message, capped at PROBE_SIZE.
+ * Results are appended to probe_results on the client.
+ */
+static void run_probe(transport* tp, const char* tl_name, const char* dev_name, int oob_sock) {
+  ucs_status_t status;
+  rank_entry entry;
+  entry.tl.tl_name = tl_name;
+  entry.tl.dev_name = dev_name;
+  entry.lat_us = -1;
+  entry.bw_gbs = 0;
+
+  latency_histogram hist;
+  if (pingpong(tp, sizeof(uint64_t), PROBE_WARMUP, PROBE_PINGS, &hist, oob_sock)) {
+    entry.lat_us = hist_percentile(&hist, 50) / 1e3;
+  }
+
+  /*
+   * Agree on the method and size with the peer
+   */
+  const uct_iface_attr_t& iface_attr = tp->iface_attr;
+  size_t own_max[] = {0, 0};
+  if (iface_attr.cap.flags & UCT_IFACE_FLAG_AM_BCOPY) own_max[0] = iface_attr.cap.am.max_bcopy;
+  if (iface_attr.cap.flags & UCT_IFACE_FLAG_AM_ZCOPY) own_max[1] = iface_attr.cap.am.max_zcopy;
+  size_t* peer_max;
+  sendrecv(oob_sock, own_max, sizeof(own_max), (void **)&peer_max);
+  rate_step step;
+  step.method = FUNC_AM_ZCOPY;
+  step.size = std::min(own_max[1], peer_max[1]);
+  if (step.size < std::max(sizeof(uint64_t), iface_attr.cap.am.min_zcopy)) {
+    step.method = FUNC_AM_BCOPY;
+    step.size = std::min(own_max[0], peer_max[0]);
+  }
+  free(peer_max);
+  step.size = std::min(step.size, PROBE_SIZE);
+
+  if (step.size >= sizeof(uint64_t)) {
+    step.iters = std::max(1L, (long)(PROBE_BYTES / step.size));
+    tp->am_count = 0;
+    tp->am_target = step.iters;
+    status = uct_iface_set_am_handler(tp->iface, RATE_AM_ID, am_count_handler, tp, 0);
+    CHECK_UCS(status);
+
+    char* buf = (char*)calloc(1, step.size);
+    uct_mem_h memh = UCT_MEM_HANDLE_NULL;
+    if (is_sender && step.method == FUNC_AM_ZCOPY && (tp->md_attr.cap.flags & UCT_MD_FLAG_NEED_MEMH)) {
+      status = uct_md_mem_reg(tp->md, buf, step.size, UCT_MD_MEM_ACCESS_RMA, &memh);
+      CHECK_UCS(status);
+    }
+
+    barrier(oob_sock);
+    if (is_sender) {
+      double start = GetTime();
+      rate_send(tp, step, buf, memh);
+      entry.bw_gbs = step.iters * step.size / 1e9 / (GetTime() - start);
+    } else {
+      progress_until(&tp->engine, [tp] { return tp->am_count >= tp->am_target; });
+    }
+    barrier(oob_sock);
+
+    if (memh != UCT_MEM_HANDLE_NULL) {
+      uct_md_mem_dereg(tp->md, memh);
+    }
+    free(buf);
+  }
+
+  if (is_sender) {
+    printf("%-24s %10.2f %10.3f\n", (entry.tl.tl_name + "/" + entry.tl.dev_name).c_str(), entry.lat_us, entry.bw_gbs);
+    probe_results.push_back(entry);
+  }
+}
+
+/*
+ * Open num_threads transports on tl_name/dev_name, connect them to the peer
+ * and run the selected benchmark. Returns false if the peer cannot be reached
+ * through this transport.
+ */
+static bool run_on_transport(const char* tl_name, const char* dev_name, bench_t bench, int oob_sock, bool verbose) {
+  /*
+   * Open one transport per thread, each pinned to its own core when running
+   * several threads.
+   */
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  std::vector<transport> tps(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    tps[i].index = i;
+    tps[i].cpu = num_threads > 1 ? i % num_cpus : -1;
+    if (!open_transport(&tps[i], tl_name, dev_name, verbose && i == 0)) {
+      printf("Transport not found.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  bool connected = true;
+  for (transport& tp : tps) {
+    if (!connect_transport(&tp, oob_sock, verbose)) {
+      connected = false;
+      break;
+    }
+    init_progress(&tp);
+  }
+
+  if (connected) {
+    uct_iface_attr_t& iface_attr = tps[0].iface_attr;
+    if (verbose) {
+      printf("max_short = %ld\n", iface_attr.cap.am.max_short);
+      printf("max_bcopy = %ld\n", iface_attr.cap.am.max_bcopy);
+      printf("max_zcopy = %ld\n", iface_attr.cap.am.max_zcopy);
+    }
+
+    std::string label = std::string(tl_name) + "/" + dev_name;
+    if (bench == BENCH_SINGLE) {
+      run_single(&tps[0], is_sender);
+    } else if (bench == BENCH_RATE) {
+      run_rate(tps, oob_sock);
+    } else if (bench == BENCH_PINGPONG) {
+      run_pingpong(&tps[0], label.c_str(), oob_sock);
+    } else if (bench == BENCH_RMA) {
+      run_rma(&tps[0], oob_sock);
+    } else if (bench == BENCH_ATOMIC) {
+      run_atomic(tps, oob_sock);
+    } else if (bench == BENCH_RCACHE) {
+      run_rcache(&tps[0]);
+    } else if (bench == BENCH_IOV) {
+      run_iov(&tps[0], oob_sock);
+    } else if (bench == BENCH_PACKER) {
+      run_packer(&tps[0]);
+    } else if (bench == BENCH_SCHED) {
+      run_sched(&tps[0], oob_sock);
+    } else if (bench == BENCH_RPC) {
+      run_rpc(&tps[0], oob_sock);
+    } else if (bench == BENCH_TAG) {
+      run_tag(&tps[0], oob_sock);
+    } else if (bench == BENCH_FLUSH) {
+      run_flush(&tps[0], oob_sock);
+    } else {
+      run_probe(&tps[0], tl_name, dev_name, oob_sock);
+    }
+  }
+
+  barrier(oob_sock);
+
+  for (transport& tp : tps) {
+    close_transport(&tp);
+  }
+  return connected;
+}
+
+/*
+ * The ranking cache holds one line per probed transport:
+ *   <host> <peer> <tl> <dev> <p50 latency us> <bandwidth GB/s>
+ * `key` is "<host> <peer>".
+ */
+static std::vector<rank_entry> load_ranking(const std::string& key) {
+  std::vector<rank_entry> ranking;
+  FILE* f = fopen(rank_cache_path.c_str(), "r");
+  if (f == NULL) return ranking;
+
+  char line[1024], host[256], peer[256], tl[256], dev[256];
+  rank_entry entry;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%255s %255s %255s %255s %lf %lf", host, peer, tl, dev, &entry.lat_us, &entry.bw_gbs) != 6 ||
+        key != std::string(host) + " " + peer) {
+      continue;
+    }
+    entry.tl.tl_name = tl;
+    entry.tl.dev_name = dev;
+    ranking.push_back(entry);
+  }
+  fclose(f);
+  return ranking;
+}
+
+/*
+ * Replace the lines of `key` in the ranking cache, keeping other hosts.
+ */
+static void save_ranking(const std::string& key, const std::vector<rank_entry>& ranking) {
+  std::vector<std::string> others;
+  char line[1024], host[256], peer[256];
+  FILE* f = fopen(rank_cache_path.c_str(), "r");
+  if (f != NULL) {
+    while (fgets(line, sizeof(line), f)) {
+      if (sscanf(line, "%255s %255s", host, peer) == 2 && key != std::string(host) + " " + peer) {
+        others.push_back(line);
+      }
+    }
+    fclose(f);
+  }
+
+  f = fopen(rank_cache_path.c_str(), "w");
+  if (f == NULL) {
+    perror("fopen");
+    return;
+  }
+  for (const std::string& other : others) {
+    fputs(other.c_str(), f);
+  }
+  for (const rank_entry& entry : ranking) {
+    fprintf(f, "%s %s %s %.3f %.3f\n", key.c_str(), entry.tl.tl_name.c_str(), entry.tl.dev_name.c_str(),
+        entry.lat_us, entry.bw_gbs);
+  }
+  fclose(f);
+}
+
+/*
+ * Pick the transport with the lowest small message latency and the one with
+ * the highest large message bandwidth. The client ranks, from the cache if it
+ * has an entry for this host pair and otherwise by probing every common
+ * transport, and sends its choice to the server.
+ * Returns false if no transport could be probed.
+ */
+static bool select_transports(int oob_sock, const char* server_name, tl_desc* small, tl_desc* large) {
+  std::vector<rank_entry> ranking;
+  std::string key;
+  if (is_sender) {
+    char host[256];
+    gethostname(host, sizeof(host));
+    key = std::string(host) + " " + server_name;
+    if (!force_probe) {
+      ranking = load_ranking(key);
+    }
+  }
+
+  if (agree(oob_sock, !is_sender || !ranking.empty())) {
+    if (is_sender) printf("Using cached transport ranking from %s\n", rank_cache_path.c_str());
+  } else {
+    printf("Probing transports...\n");
+    if (is_sender) printf("%-24s %10s %10s\n", "transport", "p50 (us)", "GB/s");
+    probe_results.clear();
+    for (const tl_desc& tl : common_transports(oob_sock)) {
+      run_on_transport(tl.tl_name.c_str(), tl.dev_name.c_str(), BENCH_PROBE, oob_sock, false);
+    }
+    ranking = probe_results;
+    if (is_sender && !ranking.empty()) {
+      save_ranking(key, ranking);
+    }
+  }
+
+  /*
+   * Rank on the client, then tell the server
+   */
+  std::string choice;
+  if (is_sender) {
+    const rank_entry* best_lat = NULL;
+    const rank_entry* best_bw = NULL;
+    for (const rank_entry& entry : ranking) {
+      if (entry.lat_us >= 0 && (best_lat == NULL || entry.lat_us < best_lat->lat_us)) best_lat = &entry;
+      if (entry.bw_gbs > 0 && (best_bw == NULL || entry.bw_gbs > best_bw->bw_gbs)) best_bw = &entry;
+    }
+    if (best_lat != NULL && best_bw != NULL) {
+      choice = best_lat->tl.tl_name + " " + best_lat->tl.dev_name + " " +
+               best_bw->tl.tl_name + " " + best_bw->tl.dev_name;
+    }
+  }
+
+  char* peer_choice;
+  sendrecv(oob_sock, choice.c_str(), choice.size() + 1, (void **)&peer_choice);
+  if (!is_sender) {
+    choice = peer_choice;
+  }
+  free(peer_choice);
+
+  char small_tl[256], small_dev[256], large_tl[256], large_dev[256];
+  if (sscanf(choice.c_str(), "%255s %255s %255s %255s", small_tl, small_dev, large_tl, large_dev) != 4) {
+    return false;
+  }
+  small->tl_name = small_tl;
+  small->dev_name = small_dev;
+  large->tl_name = large_tl;
+  large->dev_name = large_dev;
+  printf("Selected %s/%s for small messages and %s/%s for large messages\n",
+      small_tl, small_dev, large_tl, large_dev);
+  return true;
+}
+
+static void print_usage(const char* prog) {
+  printf("Usage:\n");
+  printf("  server: %s [options]\n", prog);
+  printf("  client: %s [options] [server]\n", prog);
+  printf("Options (the client sends, pass the same ones on both sides):\n");
+  printf("  -d <dev>    device name (default: %s)\n", dev_name);
+  printf("  -t <tl>     transport name, \"all\" for every transport both sides have, or \"auto\" to\n");
+  printf("              pick the fastest one for the benchmark (default: %s)\n", tl_name);
+  printf("  -C <file>   auto: transport ranking cache (default: ~/.uct_test_rank)\n");
+  printf("  -F          auto: probe transports even if the cache has a ranking\n");
+  printf("  -b <bench>  single, rate, pingpong, rma, atomic, rcache, iov, packer, sched, rpc, tag\n");
+  printf("              or flush (default: %s)\n",
+      bench_names[bench]);
+  printf("  -T <n>      rate, atomic: threads, each with its own worker, iface and ep (default: %d)\n", num_threads);
+  printf("  -m <method> short, bcopy or zcopy (default: zcopy; rate: all)\n");
+  printf("  -n <n>      rate, rma, atomic, iov, sched, tag, flush: operations per thread (endpoint) and step (default: %ld)\n", rate_iters);
+  printf("              pingpong, rpc: measured round trips (default: %ld)\n", pingpong_iters);
+  printf("              rcache: registrations per case (default: %ld)\n", rcache_iters);
+  printf("  -k <n>      sched: endpoints (default: %d)\n", sched_num_eps);
+  printf("  -s <size>   pingpong, sched: message size, at least 8 (default: %lu)\n", pingpong_size);
+  printf("  -Q          rate: receiver queues messages through the receive pool instead of only counting\n");
+  printf("  -B <size>   rate, rma, iov, tag: at most this many bytes per thread and step (default: %lu)\n", rate_max_bytes);
+  printf("  -P <copy>   bcopy packer copy: memcpy, avx2_nt, avx512_nt or auto (default: %s)\n",
+      copy_variant_names[pack_variant]);
+  printf("  -c <size>   registration cache capacity (default: %lu)\n", rcache_capacity);
+  printf("  -p <mode>   progress engine: poll, wait, eventfd or adaptive (default: %s)\n",
+      progress_mode_names[progress_mode]);
+}
+
+int main(int argc, char** argv) {
+  /* args setup */
+  char* server_name = NULL;
+  int c;
+  while ((c = getopt(argc, argv, "d:t:b:m:T:n:k:s:QB:P:c:p:C:Fh")) != -1) {
+    switch (c) {
+      case 'd':
+        dev_name = optarg;
+        break;
+      case 't':
+        tl_name = optarg;
+        break;
+      case 'b':
+        if (!strcmp(optarg, "single")) {
+          bench = BENCH_SINGLE;
+        } else if (!strcmp(optarg, "rate")) {
+          bench = BENCH_RATE;
+        } else if (!strcmp(optarg, "pingpong")) {
+          bench = BENCH_PINGPONG;
+        } else if (!strcmp(optarg, "rma")) {
+          bench = BENCH_RMA;
+        } else if (!strcmp(optarg, "atomic")) {
+          bench = BENCH_ATOMIC;
+        } else if (!strcmp(optarg, "rcache")) {
+          bench = BENCH_RCACHE;
+        } else if (!strcmp(optarg, "iov")) {
+          bench = BENCH_IOV;
+        } else if (!strcmp(optarg, "packer")) {
+          bench = BENCH_PACKER;
+        } else if (!strcmp(optarg, "sched")) {
+          bench = BENCH_SCHED;
+        } else if (!strcmp(optarg, "rpc")) {
+          bench = BENCH_RPC;
+        } else if (!strcmp(optarg, "tag")) {
+          bench = BENCH_TAG;
+        } else if (!strcmp(optarg, "flush")) {
+          bench = BENCH_FLUSH;
+        } else {
+          print_usage(argv[0]);
+          return 0;
+        }
+        break;
+      case 'm':
+        if (!strcmp(optarg, "short")) {
+          func_am_type = FUNC_AM_SHORT;
+        } else if (!strcmp(optarg, "bcopy")) {
+          func_am_type = FUNC_AM_BCOPY;
+        } else if (!strcmp(optarg, "zcopy")) {
+          func_am_type = FUNC_AM_ZCOPY;
+        } else {
+          print_usage(argv[0]);
+          return 0;
+        }
+        rate_methods = UCS_BIT(func_am_type);
+        break;
+      case 'T':
+        num_threads = atoi(optarg);
+        break;
+      case 'n':
+        rate_iters = pingpong_iters = rcache_iters = atol(optarg);
+        break;
+      case 'k':
+        sched_num_eps = atoi(optarg);
+        break;
+      case 's':
+        pingpong_size = parse_size(optarg);
+        break;
+      case 'Q':
+        rate_queue = true;
+        break;
+      case 'P': {
+        int i = COPY_MEMCPY;
+        while (i <= COPY_AUTO && strcmp(optarg, copy_variant_names[i])) ++i;
+        if (i > COPY_AUTO || (pack_copy = copy_select((copy_variant_t)i)) == NULL) {
+          printf("Unsupported packer copy: %s\n", optarg);
+          return 1;
+        }
+        pack_variant = (copy_variant_t)i;
+        break;
+      }
+      case 'c':
+        rcache_capacity = parse_size(optarg);
+        break;
+      case 'C':
+        rank_cache_path = optarg;
+        break;
+      case 'F':
+        force_probe = true;
+        break;
+      case 'B':
+        rate_max_bytes = parse_size(optarg);
+        break;
+      case 'p':
+        if (parse_progress_mode(optarg, &progress_mode)) break;
+        /* Fall through */
+      default:
+        print_usage(argv[0]);
+        return 0;
+    }
+  }
+  if (num_threads <= 0 || sched_num_eps <= 0 || rate_iters <= 0 || rate_max_bytes == 0 || pingpong_size < sizeof(uint64_t)) {
+    print_usage(argv[0]);
+    return 0;
+  }
+  if (optind + 1 == argc) {
+    // client
+    server_name = argv[optind];
+  }
+  is_sender = server_name != NULL;
+  uint16_t server_port = 13337;
+  ucs_memory_type_t test_mem_type = UCS_MEMORY_TYPE_HOST; // HOST / CUDA / CUDA_MANAGED
+
+  if (bench != BENCH_RATE && bench != BENCH_ATOMIC) {
+    num_threads = 1;
+  }
+
+  /*
+   * Open out-of-band connection
+   */
+  int oob_sock;
+  if (server_name) {
+    oob_sock = client_connect(server_name, server_port);
+  } else {
+    oob_sock = server_connect(server_port);
+  }
+
+  if (bench == BENCH_PINGPONG) {
+    print_pingpong_header();
+  }
+
+  if (!strcmp(tl_name, "auto")) {
+    /*
+     * Small message benchmarks run on the lowest latency transport, and the
+     * size sweeps on the highest bandwidth one
+     */
+    if (rank_cache_path.empty()) {
+      const char* home = getenv("HOME");
+      rank_cache_path = std::string(home ? home : ".") + "/.uct_test_rank";
+    }
+    tl_desc small, large;
+    if (!select_transports(oob_sock, server_name, &small, &large)) {
+      printf("No usable transport found.\n");
+      return 1;
+    }
+    const tl_desc& tl = bench == BENCH_RATE || bench == BENCH_RMA || bench == BENCH_IOV ||
+                          bench == BENCH_TAG ? large : small;
+    run_on_transport(tl.tl_name.c_str(), tl.dev_name.c_str(), bench, oob_sock, true);
+  } else if (!strcmp(tl_name, "all")) {
+    /*
+     * Run on every transport both sides have, skipping unreachable ones
+     */
+    for (const tl_desc& tl : common_transports(oob_sock)) {
+      if (!run_on_transport(tl.tl_name.c_str(), tl.dev_name.c_str(), bench, oob_sock, false)) {
+        printf("%s/%s is not reachable. Skipping.\n", tl.tl_name.c_str(), tl.dev_name.c_str());
+      }
+    }
+  } else if (!run_on_transport(tl_name, dev_name, bench, oob_sock, true)) {
+    printf("Peer is not reachable through %s/%s.\n", tl_name, dev_name);
+  }
 
   return 0;
 }
@@ -1,12 +1,20 @@
 #pragma once
 
 #include <cstdlib>
+#include <cstdint>
 #include <ctime>
+#include <vector>
+#include <algorithm>
+#include <cerrno>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
 #include <netdb.h>
 
+#include <ucs/type/status.h>
+
 #define CHECK_UCS(status) \
   do { \
     ucs_status_t CHECK_UCS_status = (status); \
@@ -31,6 +39,256 @@ static double GetTime() {
   return t.tv_sec + t.tv_nsec / 1e9;
 }
 
+/*
+ * User plus system CPU time of the whole process, including UCX threads.
+ */
+static double GetCpuTime() {
+  rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+       + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/*
+ * Parse a size with an optional K/M/G suffix (powers of two), e.g. "64K".
+ * Returns 0 on malformed input.
+ */
+static size_t parse_size(const char* str) {
+  char* end;
+  size_t val = strtoull(str, &end, 10);
+  switch (*end) {
+    case 'k': case 'K': val <<= 10; ++end; break;
+    case 'm': case 'M': val <<= 20; ++end; break;
+    case 'g': case 'G': val <<= 30; ++end; break;
+  }
+  return (end == str || *end != '\0') ? 0 : val;
+}
+
+struct lat_stats {
+  double min, avg, p50, p99;
+};
+
+/*
+ * Summarize per-message times (in seconds). Sorts samples in place.
+ */
+static lat_stats get_lat_stats(std::vector<double>& samples) {
+  lat_stats st = {0, 0, 0, 0};
+  if (samples.empty()) return st;
+
+  std::sort(samples.begin(), samples.end());
+  double sum = 0;
+  for (double s : samples) sum += s;
+
+  size_t n = samples.size();
+  st.min = samples[0];
+  st.avg = sum / n;
+  st.p50 = samples[(n - 1) * 50 / 100];
+  st.p99 = samples[(n - 1) * 99 / 100];
+  return st;
+}
+
+/*
+ * Log-linear histogram in the spirit of HdrHistogram. Values below
+ * 2^HIST_SUB_BITS get a bucket each; every higher power of two is split into
+ * 2^HIST_SUB_BITS linear sub-buckets, so a reported percentile is within
+ * 1/2^HIST_SUB_BITS (about 3%) of the recorded value. Recording is O(1)
+ * and never allocates.
+ */
+static const int HIST_SUB_BITS = 5;
+static const int HIST_SUB_COUNT = 1 << HIST_SUB_BITS;
+
+struct latency_histogram {
+  std::vector<uint64_t> counts;
+  uint64_t total;
+  uint64_t min, max;
+};
+
+static void hist_init(latency_histogram* h) {
+  h->counts.assign((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT, 0);
+  h->total = 0;
+  h->min = UINT64_MAX;
+  h->max = 0;
+}
+
+static void hist_record(latency_histogram* h, uint64_t value) {
+  size_t idx;
+  if (value < (uint64_t)HIST_SUB_COUNT) {
+    idx = value;
+  } else {
+    int msb = 63 - __builtin_clzll(value);
+    uint64_t sub = value >> (msb - HIST_SUB_BITS);   // in [HIST_SUB_COUNT, 2 * HIST_SUB_COUNT)
+    idx = (msb - HIST_SUB_BITS + 1) * HIST_SUB_COUNT + (sub - HIST_SUB_COUNT);
+  }
+  ++h->counts[idx];
+  ++h->total;
+  h->min = std::min(h->min, value);
+  h->max = std::max(h->max, value);
+}
+
+/*
+ * Highest value that falls into the same bucket as the p-th percentile.
+ */
+static uint64_t hist_percentile(const latency_histogram* h, double p) {
+  if (h->total == 0) return 0;
+
+  uint64_t target = std::max<uint64_t>(1, (uint64_t)(p / 100 * h->total + 0.5));
+  uint64_t seen = 0;
+  for (size_t idx = 0; idx < h->counts.size(); ++idx) {
+    seen += h->counts[idx];
+    if (seen < target) continue;
+    if (idx < (size_t)HIST_SUB_COUNT) return std::min<uint64_t>(idx, h->max);
+
+    int shift = idx / HIST_SUB_COUNT - 1;
+    uint64_t sub = idx % HIST_SUB_COUNT + HIST_SUB_COUNT;
+    return std::min(((sub + 1) << shift) - 1, h->max);
+  }
+  return h->max;
+}
+
+enum progress_mode_t {
+  PROGRESS_MODE_POLL,
+  PROGRESS_MODE_WAIT,
+  PROGRESS_MODE_EVENTFD,
+  PROGRESS_MODE_ADAPTIVE
+};
+static const char* progress_mode_names[] = {"poll", "wait", "eventfd", "adaptive"};
+
+static bool parse_progress_mode(const char* str, progress_mode_t* mode) {
+  for (int i = PROGRESS_MODE_POLL; i <= PROGRESS_MODE_ADAPTIVE; ++i) {
+    if (!strcmp(str, progress_mode_names[i])) {
+      *mode = (progress_mode_t)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Progress engine shared by the UCT and UCP tests. It spins on `progress`
+ * and, depending on the mode, sleeps on the event fd after `arm` (or in
+ * `wait`, if given) when there is nothing to do:
+ *   poll     - never sleep
+ *   wait     - sleep as soon as a progress call finds nothing
+ *   eventfd  - same as wait, but always through arm + epoll_wait
+ *   adaptive - spin for a budget learned from recent completion times, then
+ *              sleep like eventfd
+ */
+struct progress_engine {
+  progress_mode_t mode;
+  void* arg;
+  unsigned (*progress)(void* arg);
+  ucs_status_t (*arm)(void* arg);
+  ucs_status_t (*wait)(void* arg);
+  int epoll_fd;
+
+  double avg_completion;   // moving average of progress_until duration (s)
+  double spin_budget;      // current spin time before sleeping (s)
+
+  unsigned long spins;     // progress calls
+  unsigned long arms;      // successful arm calls
+  unsigned long wakeups;   // returns from sleeping
+};
+
+static const double PROGRESS_MIN_SPIN = 1e-6;
+static const double PROGRESS_MAX_SPIN = 100e-6;
+
+static void progress_engine_init(progress_engine* pe, progress_mode_t mode, void* arg,
+                                 unsigned (*progress)(void*), ucs_status_t (*arm)(void*),
+                                 ucs_status_t (*wait)(void*), int event_fd) {
+  pe->mode = mode;
+  pe->arg = arg;
+  pe->progress = progress;
+  pe->arm = arm;
+  pe->wait = wait;
+  pe->epoll_fd = -1;
+  pe->avg_completion = PROGRESS_MAX_SPIN;
+  pe->spin_budget = PROGRESS_MAX_SPIN;
+  pe->spins = pe->arms = pe->wakeups = 0;
+
+  if (mode == PROGRESS_MODE_POLL || (mode == PROGRESS_MODE_WAIT && wait != NULL)) {
+    return;
+  }
+
+  /*
+   * Watch a copy of the event fd, as recommended by UCX
+   */
+  pe->epoll_fd = epoll_create(1);
+  CHECK_COND(pe->epoll_fd >= 0);
+
+  epoll_event ev;
+  ev.data.fd = event_fd;
+  ev.events = EPOLLIN;
+  int ret = epoll_ctl(pe->epoll_fd, EPOLL_CTL_ADD, event_fd, &ev);
+  CHECK_COND(ret == 0);
+}
+
+static void progress_engine_cleanup(progress_engine* pe) {
+  if (pe->epoll_fd >= 0) close(pe->epoll_fd);
+  pe->epoll_fd = -1;
+}
+
+/*
+ * Sleep until the transport signals an event. Returns immediately if events
+ * arrived between the last progress call and arming.
+ */
+static void progress_engine_sleep(progress_engine* pe) {
+  if (pe->mode == PROGRESS_MODE_WAIT && pe->wait != NULL) {
+    CHECK_UCS(pe->wait(pe->arg));
+    ++pe->wakeups;
+    return;
+  }
+
+  ucs_status_t status = pe->arm(pe->arg);
+  if (status == UCS_ERR_BUSY) { /* some events are arrived already */
+    return;
+  }
+  CHECK_UCS(status);
+  ++pe->arms;
+
+  epoll_event ev;
+  int ret;
+  do {
+    ret = epoll_wait(pe->epoll_fd, &ev, 1, -1);
+  } while ((ret == -1) && (errno == EINTR));
+  CHECK_COND(ret >= 0);
+  ++pe->wakeups;
+}
+
+/*
+ * Progress until done() returns true.
+ */
+template <typename Cond>
+static void progress_until(progress_engine* pe, Cond done) {
+  if (done()) return;
+
+  double st = pe->mode == PROGRESS_MODE_ADAPTIVE ? GetTime() : 0;
+  do {
+    ++pe->spins;
+    if (pe->progress(pe->arg) != 0 || pe->mode == PROGRESS_MODE_POLL) continue;
+    if (pe->mode == PROGRESS_MODE_ADAPTIVE && GetTime() - st < pe->spin_budget) continue;
+    progress_engine_sleep(pe);
+  } while (!done());
+
+  if (pe->mode == PROGRESS_MODE_ADAPTIVE) {
+    /*
+     * Spin about twice as long as a typical completion takes. If completions
+     * usually take longer than we are willing to spin, spinning only burns
+     * CPU, so fall back to the minimum.
+     */
+    pe->avg_completion = 0.875 * pe->avg_completion + 0.125 * (GetTime() - st);
+    if (pe->avg_completion > PROGRESS_MAX_SPIN) {
+      pe->spin_budget = PROGRESS_MIN_SPIN;
+    } else {
+      pe->spin_budget = std::max(PROGRESS_MIN_SPIN, std::min(PROGRESS_MAX_SPIN, 2 * pe->avg_completion));
+    }
+  }
+}
+
+static void progress_engine_print(const progress_engine* pe) {
+  printf("Progress engine %s: spins=%lu arms=%lu wakeups=%lu spin_budget=%.2f us\n",
+      progress_mode_names[pe->mode], pe->spins, pe->arms, pe->wakeups, pe->spin_budget * 1e6);
+}
+
 static int server_connect(uint16_t server_port) {
   struct sockaddr_in inaddr;
   int lsock, dsock, optval, ret;
@@ -140,6 +398,18 @@ static int barrier(int oob_sock) {
   return !(res == sizeof(dummy));
 }
 
+/*
+ * Returns true on both sides only if `ok` is true on both sides.
+ */
+static bool agree(int oob_sock, bool ok) {
+  int own = ok;
+  int* peer;
+  if (sendrecv(oob_sock, &own, sizeof(own), (void **)&peer) != 0) return false;
+  ok = ok && *peer;
+  free(peer);
+  return ok;
+}
+
 static void print_addrinfo(addrinfo* res) {
   for (addrinfo* it = res; it != NULL; it = it->ai_next) {
     char host[99], serv[99];